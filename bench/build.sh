@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Builds nginx with the module into bench/work/nginx for run.sh:
+#
+#   bench/build.sh                  downloads nginx $NGINX_VERSION from nginx.org
+#   bench/build.sh /path/to/nginx   uses nginx source tree
+#
+# Extra ./configure arguments can be passed in NGINX_CONFIGURE_ARGS.
+
+set -e
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+module_dir=$(dirname "$bench_dir")
+work=$bench_dir/work
+version=${NGINX_VERSION:-1.26.2}
+
+mkdir -p "$work"
+
+if [ -n "$1" ]; then
+    src=$(cd "$1" && pwd)
+else
+    src=$work/nginx-$version
+    if [ ! -d "$src" ]; then
+        curl -fsSL "https://nginx.org/download/nginx-$version.tar.gz" | tar -xz -C "$work"
+    fi
+fi
+
+cd "$src"
+./configure --prefix="$work/nginx" --with-http_ssl_module --with-threads \
+    --add-module="$module_dir" $NGINX_CONFIGURE_ARGS
+make -j"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)"
+make install
+
+"$work/nginx/sbin/nginx" -V
@@ -0,0 +1,491 @@
+#!/usr/bin/env python3
+"""
+Scripted LDAPv3 server for load tests of nginx-auth-ldap, no dependencies beyond python 3.7.
+
+Answers simple bind, search, compare, abandon and unbind over a generated directory:
+
+  cn=admin,<suffix>                  service account, password --bind-password
+  uid=user<N>,ou=people,<suffix>     N < --users, objectClass person, password --password,
+                                     memberOf lists the groups of the user
+  cn=group<K>,ou=groups,<suffix>     K < --groups, every user is a member of groups --member-of
+
+Searches find entries by equality on uid or cn (as the module searches users), then check
+the whole filter and the scope. Latency and failures can be injected into every answer:
+
+  --latency 5 --jitter 2             answer after 3..7ms
+  --fail-rate 0.1 --fail-mode busy   answer 10% of operations with busy (also: unavailable,
+                                     close - drop the connection, hang - never answer)
+
+--workers forks processes sharing the listening socket. Operation counters are printed
+when the server is stopped (SIGINT or SIGTERM).
+"""
+
+import argparse
+import asyncio
+import os
+import random
+import re
+import signal
+import socket
+import sys
+
+# protocol operations
+BIND_REQUEST = 0x60
+BIND_RESPONSE = 0x61
+UNBIND_REQUEST = 0x42
+SEARCH_REQUEST = 0x63
+SEARCH_RESULT_ENTRY = 0x64
+SEARCH_RESULT_DONE = 0x65
+COMPARE_REQUEST = 0x6e
+COMPARE_RESPONSE = 0x6f
+ABANDON_REQUEST = 0x50
+EXTENDED_REQUEST = 0x77
+EXTENDED_RESPONSE = 0x78
+
+# result codes
+SUCCESS = 0
+PROTOCOL_ERROR = 2
+COMPARE_FALSE = 5
+COMPARE_TRUE = 6
+AUTH_METHOD_NOT_SUPPORTED = 7
+NO_SUCH_OBJECT = 32
+INVALID_CREDENTIALS = 49
+BUSY = 51
+UNAVAILABLE = 52
+UNWILLING_TO_PERFORM = 53
+
+SCOPE_BASE, SCOPE_ONE, SCOPE_SUB = 0, 1, 2
+
+
+# BER encoding, only what LDAP messages need
+
+def ber_len(n):
+    if n < 0x80:
+        return bytes([n])
+    b = n.to_bytes((n.bit_length() + 7) // 8, 'big')
+    return bytes([0x80 | len(b)]) + b
+
+
+def tlv(tag, content):
+    return bytes([tag]) + ber_len(len(content)) + content
+
+
+def ber_int(v, tag=0x02):
+    return tlv(tag, v.to_bytes(max(1, (v.bit_length() + 8) // 8), 'big', signed=True))
+
+
+def ber_str(s, tag=0x04):
+    return tlv(tag, s if isinstance(s, bytes) else s.encode())
+
+
+def ber_read(data, pos):
+    """Returns tag, content and position after the element, or None if data is incomplete"""
+    if pos + 2 > len(data):
+        return None
+    tag = data[pos]
+    n = data[pos + 1]
+    pos += 2
+    if n & 0x80:
+        k = n & 0x7f
+        if pos + k > len(data):
+            return None
+        n = int.from_bytes(data[pos:pos + k], 'big')
+        pos += k
+    if pos + n > len(data):
+        return None
+    return tag, data[pos:pos + n], pos + n
+
+
+def ber_items(data):
+    pos = 0
+    while pos < len(data):
+        tag, content, pos = ber_read(data, pos)
+        yield tag, content
+
+
+def ber_to_int(content):
+    return int.from_bytes(content, 'big', signed=True)
+
+
+def ldap_result(op, code, matched=b'', message=b''):
+    return tlv(op, ber_int(code, 0x0a) + ber_str(matched) + ber_str(message))
+
+
+def ldap_message(msgid, op):
+    return tlv(0x30, ber_int(msgid) + op)
+
+
+# filters are decoded into tuples: ('and', [...]), ('or', [...]), ('not', f),
+# ('eq', attr, value), ('present', attr), ('sub', attr, initial, [any], final), ('any',)
+
+def decode_filter(tag, content):
+    if tag == 0xa0:
+        return ('and', [decode_filter(t, c) for t, c in ber_items(content)])
+    if tag == 0xa1:
+        return ('or', [decode_filter(t, c) for t, c in ber_items(content)])
+    if tag == 0xa2:
+        t, c, _ = ber_read(content, 0)
+        return ('not', decode_filter(t, c))
+    if tag == 0xa3:
+        (_, attr), (_, value) = ber_items(content)
+        return ('eq', attr.decode().lower(), value.decode().lower())
+    if tag == 0x87:
+        return ('present', content.decode().lower())
+    if tag == 0xa4:
+        items = list(ber_items(content))
+        initial, middle, final = '', [], ''
+        for t, c in ber_items(items[1][1]):
+            if t == 0x80:
+                initial = c.decode().lower()
+            elif t == 0x81:
+                middle.append(c.decode().lower())
+            else:
+                final = c.decode().lower()
+        return ('sub', items[0][1].decode().lower(), initial, middle, final)
+    # ordering, approximate and extensible matches are not used by the module
+    return ('any',)
+
+
+def match_filter(f, entry):
+    kind = f[0]
+    if kind == 'and':
+        return all(match_filter(g, entry) for g in f[1])
+    if kind == 'or':
+        return any(match_filter(g, entry) for g in f[1])
+    if kind == 'not':
+        return not match_filter(f[1], entry)
+    if kind == 'eq':
+        return f[2] in (v.lower() for v in entry.get(f[1], ()))
+    if kind == 'present':
+        return f[1] == 'objectclass' or f[1] in entry
+    if kind == 'sub':
+        pattern = '.*'.join(re.escape(s) for s in [f[2]] + f[3] + [f[4]])
+        return any(re.fullmatch(pattern, v.lower()) for v in entry.get(f[1], ()))
+    return True
+
+
+def filter_keys(f, keys):
+    """Collects values of equality assertions on uid and cn, entries are looked up by them"""
+    if f[0] in ('and', 'or'):
+        for g in f[1]:
+            filter_keys(g, keys)
+    elif f[0] == 'eq' and f[1] in ('uid', 'cn'):
+        keys.append(f[2])
+    return keys
+
+
+class Directory:
+    def __init__(self, args):
+        self.suffix = args.suffix.lower()
+        self.people = 'ou=people,' + self.suffix
+        self.groups_base = 'ou=groups,' + self.suffix
+        self.bind_dn = 'cn=admin,' + self.suffix
+        self.bind_password = args.bind_password.encode()
+        self.password = args.password.encode()
+        self.users = args.users
+        self.groups = args.groups
+        if args.member_of == 'all':
+            self.member_of = set(range(self.groups))
+        elif args.member_of == 'none':
+            self.member_of = set()
+        else:
+            self.member_of = {int(k) % self.groups for k in args.member_of.split(',')} if self.groups else set()
+        self.memberships = ['cn=group%d,%s' % (k, self.groups_base) for k in sorted(self.member_of)]
+
+    def user_dn(self, n):
+        return 'uid=user%d,%s' % (n, self.people)
+
+    def user_number(self, name):
+        m = re.fullmatch(r'user(\d+)', name)
+        if m and int(m.group(1)) < self.users:
+            return int(m.group(1))
+        return None
+
+    def user(self, n):
+        uid = 'user%d' % n
+        return self.user_dn(n), {'objectclass': ['top', 'person', 'inetOrgPerson'], 'uid': [uid], 'cn': [uid],
+                                 'memberof': self.memberships}
+
+    def group(self, k):
+        cn = 'group%d' % k
+        return 'cn=%s,%s' % (cn, self.groups_base), {'objectclass': ['top', 'groupOfNames'], 'cn': [cn]}
+
+    def entry(self, dn):
+        """Entry for the DN, None if there is no such entry"""
+        dn = dn.lower().replace(', ', ',')
+        if dn == '':
+            return '', {'objectclass': ['top']}
+        rdn, _, parent = dn.partition(',')
+        if parent == self.people and rdn.startswith('uid='):
+            n = self.user_number(rdn[4:])
+            return self.user(n) if n is not None else None
+        if parent == self.groups_base and rdn.startswith('cn=group') and rdn[8:].isdigit():
+            k = int(rdn[8:])
+            return self.group(k) if k < self.groups else None
+        if dn == self.bind_dn:
+            return dn, {'objectclass': ['top', 'person'], 'cn': ['admin']}
+        if dn in (self.suffix, self.people, self.groups_base):
+            return dn, {'objectclass': ['top', 'organizationalUnit']}
+        return None
+
+    def bind(self, dn, password):
+        dn = dn.lower().replace(', ', ',')
+        if dn == '':
+            return SUCCESS if password == b'' else UNWILLING_TO_PERFORM
+        if dn == self.bind_dn:
+            return SUCCESS if password == self.bind_password else INVALID_CREDENTIALS
+        if self.entry(dn) is not None and dn.startswith('uid='):
+            return SUCCESS if password == self.password else INVALID_CREDENTIALS
+        return INVALID_CREDENTIALS
+
+    def search(self, base, scope, f):
+        base = base.lower().replace(', ', ',')
+        if scope == SCOPE_BASE:
+            candidates = [self.entry(base)]
+        else:
+            candidates = []
+            for key in filter_keys(f, []):
+                n = self.user_number(key)
+                if n is not None:
+                    candidates.append(self.user(n))
+                elif key.startswith('group') and key[5:].isdigit() and int(key[5:]) < self.groups:
+                    candidates.append(self.group(int(key[5:])))
+        for candidate in candidates:
+            if candidate is None:
+                continue
+            dn, attrs = candidate
+            if scope != SCOPE_BASE:
+                if not dn.endswith(',' + base) and base != '':
+                    continue
+                if scope == SCOPE_ONE and dn.partition(',')[2] != base:
+                    continue
+            if match_filter(f, attrs):
+                yield dn, attrs
+
+    def compare(self, dn, attr, value):
+        entry = self.entry(dn)
+        if entry is None:
+            return NO_SUCH_OBJECT
+        edn, attrs = entry
+        value = value.lower()
+        if edn.startswith('cn=group') and attr in ('member', 'uniquemember', 'memberuid'):
+            k = int(edn[8:].partition(',')[0])
+            if k not in self.member_of:
+                return COMPARE_FALSE
+            name = value.partition(',')[0][4:] if value.startswith('uid=') else value
+            if self.user_number(name) is None:
+                return COMPARE_FALSE
+            return COMPARE_TRUE if value in (name, self.user_dn(int(name[4:]))) else COMPARE_FALSE
+        return COMPARE_TRUE if value in (v.lower() for v in attrs.get(attr, ())) else COMPARE_FALSE
+
+
+class Connection:
+    def __init__(self, server, reader, writer):
+        self.server = server
+        self.reader = reader
+        self.writer = writer
+        self.abandoned = set()
+
+    async def run(self):
+        data = b''
+        try:
+            while True:
+                chunk = await self.reader.read(65536)
+                if not chunk:
+                    break
+                data += chunk
+                while True:
+                    element = ber_read(data, 0)
+                    if element is None:
+                        break
+                    tag, content, pos = element
+                    data = data[pos:]
+                    try:
+                        if tag != 0x30 or not self.message(content):
+                            return
+                    except (ValueError, IndexError, TypeError, StopIteration, UnicodeDecodeError):
+                        # malformed request, the client gets the connection closed like from a real server
+                        return
+        except (ConnectionError, asyncio.IncompleteReadError):
+            pass
+        finally:
+            self.writer.close()
+
+    def message(self, content):
+        """Dispatches one LDAPMessage, returns False when the connection is to be closed"""
+        items = ber_items(content)
+        _, msgid = next(items)
+        msgid = ber_to_int(msgid)
+        op, body = next(items)
+        stats = self.server.stats
+
+        if op == UNBIND_REQUEST:
+            stats['unbind'] += 1
+            return False
+        if op == ABANDON_REQUEST:
+            stats['abandon'] += 1
+            self.abandoned.add(ber_to_int(body))
+            return True
+
+        failure = self.server.failure()
+        if failure:
+            stats['failed'] += 1
+        if failure == 'close':
+            return False
+        if failure == 'hang':
+            return True
+
+        if op == BIND_REQUEST:
+            stats['bind'] += 1
+            (_, version), (_, name), (auth, password) = ber_items(body)
+            if failure:
+                code = failure
+            elif auth != 0x80:
+                code = AUTH_METHOD_NOT_SUPPORTED
+            else:
+                code = self.server.directory.bind(name.decode(), password)
+            self.reply(msgid, [ldap_result(BIND_RESPONSE, code)])
+        elif op == SEARCH_REQUEST:
+            stats['search'] += 1
+            items = list(ber_items(body))
+            base = items[0][1].decode()
+            scope = ber_to_int(items[1][1])
+            size_limit = ber_to_int(items[3][1])
+            f = decode_filter(*items[6])
+            wanted = [a.decode().lower() for _, a in ber_items(items[7][1])]
+            answer = []
+            if failure:
+                answer.append(ldap_result(SEARCH_RESULT_DONE, failure))
+            else:
+                for dn, attrs in self.server.directory.search(base, scope, f):
+                    answer.append(self.entry(dn, attrs, wanted))
+                    if size_limit and len(answer) == size_limit:
+                        break
+                answer.append(ldap_result(SEARCH_RESULT_DONE, SUCCESS))
+            self.reply(msgid, answer)
+        elif op == COMPARE_REQUEST:
+            stats['compare'] += 1
+            items = list(ber_items(body))
+            (_, attr), (_, value) = ber_items(items[1][1])
+            code = failure or self.server.directory.compare(items[0][1].decode(), attr.decode().lower(), value.decode())
+            self.reply(msgid, [ldap_result(COMPARE_RESPONSE, code)])
+        elif op == EXTENDED_REQUEST:
+            # StartTLS and whoami are not offered
+            self.reply(msgid, [ldap_result(EXTENDED_RESPONSE, UNWILLING_TO_PERFORM)])
+        else:
+            self.reply(msgid, [ldap_result(EXTENDED_RESPONSE, PROTOCOL_ERROR, message=b'operation not supported')])
+            return False
+        return True
+
+    @staticmethod
+    def entry(dn, attrs, wanted):
+        if '1.1' in wanted:
+            names = []
+        elif not wanted or '*' in wanted:
+            names = list(attrs)
+        else:
+            names = [a for a in wanted if a in attrs]
+        encoded = b''.join(tlv(0x30, ber_str(a) + tlv(0x31, b''.join(ber_str(v) for v in attrs[a]))) for a in names)
+        return tlv(SEARCH_RESULT_ENTRY, ber_str(dn) + tlv(0x30, encoded))
+
+    def reply(self, msgid, ops):
+        delay = self.server.delay()
+        packet = b''.join(ldap_message(msgid, op) for op in ops)
+        if delay <= 0:
+            self.writer.write(packet)
+        else:
+            asyncio.get_running_loop().call_later(delay, self.send_later, msgid, packet)
+
+    def send_later(self, msgid, packet):
+        if msgid in self.abandoned:
+            self.abandoned.discard(msgid)
+            return
+        if not self.writer.is_closing():
+            self.writer.write(packet)
+
+
+class Server:
+    def __init__(self, args):
+        self.args = args
+        self.directory = Directory(args)
+        self.stats = dict.fromkeys(['connections', 'bind', 'search', 'compare', 'abandon', 'unbind', 'failed'], 0)
+        self.fail_code = {'busy': BUSY, 'unavailable': UNAVAILABLE}.get(args.fail_mode, args.fail_mode)
+
+    def delay(self):
+        ms = self.args.latency
+        if self.args.jitter:
+            ms += random.uniform(-self.args.jitter, self.args.jitter)
+        return ms / 1000.0
+
+    def failure(self):
+        """Result code, 'close' or 'hang' if the operation is to fail, otherwise None"""
+        if self.args.fail_rate and random.random() < self.args.fail_rate:
+            return self.fail_code
+        return None
+
+    async def connection(self, reader, writer):
+        self.stats['connections'] += 1
+        await Connection(self, reader, writer).run()
+
+    def serve(self, sock, children):
+        loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(loop)
+        stop = loop.create_future()
+
+        def shutdown(sig):
+            for child in children:
+                os.kill(child, sig)
+            if not stop.done():
+                stop.set_result(None)
+
+        for sig in (signal.SIGINT, signal.SIGTERM):
+            loop.add_signal_handler(sig, shutdown, sig)
+        server = loop.run_until_complete(asyncio.start_server(self.connection, sock=sock, backlog=1024))
+        loop.run_until_complete(stop)
+        server.close()
+        for child in children:
+            os.waitpid(child, 0)
+        print('ldap_responder %d: %s' % (os.getpid(), ' '.join('%s=%d' % kv for kv in self.stats.items())),
+              file=sys.stderr, flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--listen', default='127.0.0.1:3891', help='address:port (default %(default)s)')
+    parser.add_argument('--workers', type=int, default=1, help='processes sharing the socket (default %(default)s)')
+    parser.add_argument('--suffix', default='dc=example,dc=com', help='directory suffix (default %(default)s)')
+    parser.add_argument('--bind-password', default='admin', help='password of cn=admin,<suffix> (default %(default)s)')
+    parser.add_argument('--password', default='secret', help='password of every user (default %(default)s)')
+    parser.add_argument('--users', type=int, default=100000000, help='number of users (default %(default)s)')
+    parser.add_argument('--groups', type=int, default=20, help='number of groups (default %(default)s)')
+    parser.add_argument('--member-of', default='-1',
+                        help='groups every user is a member of: comma separated numbers, negative count from the '
+                             'last group, "all" or "none" (default: the last group)')
+    parser.add_argument('--latency', type=float, default=0, help='delay of every answer in ms (default %(default)s)')
+    parser.add_argument('--jitter', type=float, default=0, help='random +- delay in ms (default %(default)s)')
+    parser.add_argument('--fail-rate', type=float, default=0, help='share of failed operations, 0..1 (default %(default)s)')
+    parser.add_argument('--fail-mode', default='busy', choices=['busy', 'unavailable', 'close', 'hang'],
+                        help='how operations fail (default %(default)s)')
+    args = parser.parse_args()
+
+    host, _, port = args.listen.rpartition(':')
+    sock = socket.socket(socket.AF_INET6 if ':' in host else socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind((host.strip('[]'), int(port)))
+    sock.listen(1024)
+    sock.setblocking(False)
+
+    server = Server(args)
+    children = []
+    for _ in range(args.workers - 1):
+        pid = os.fork()
+        if pid == 0:
+            server.serve(sock, [])
+            os._exit(0)
+        children.append(pid)
+
+    server.serve(sock, children)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,208 @@
+#!/bin/sh
+#
+# Runs load test scenarios against nginx built by build.sh and the scripted LDAP server:
+#
+#   bench/run.sh                    all scenarios
+#   bench/run.sh cold warm          some of them
+#
+# Scenarios:
+#
+#   cold            every request is a new user, so every request is a cache miss
+#   warm            1000 users, sent once before the run, so requests are cache hits
+#   wrong-password  1000 users with a wrong password, negative cache after warm-up
+#   groups          new users, 20 "require group" rules, the user is a member of the last one
+#   slow-first      new users, first of two servers answers after 200ms (hedging)
+#   dead-first      new users, first of two servers accepts connections but never answers
+#                   (timeouts, max_fails)
+#
+# Settings, from the environment:
+#
+#   BENCH_MODE        async (default), threads or sync
+#   BENCH_WORKERS     nginx worker processes (default 2)
+#   BENCH_DURATION    wrk -d (default 30s)
+#   BENCH_WARMUP      length of warm-up run (default 5s)
+#   BENCH_THREADS     wrk -t (default 4)
+#   BENCH_CONNECTIONS wrk -c (default 64)
+#   BENCH_LATENCY     latency of the LDAP server in ms (default 1)
+#   BENCH_RESPONDERS  processes of each LDAP server (default 2)
+#   NGINX             nginx binary (default bench/work/nginx/sbin/nginx)
+#
+# nginx listens on 127.0.0.1:8089 (status on 8090), LDAP servers on 127.0.0.1:3891 and 3892.
+# Results, wrk output, auth_ldap_status and nginx logs of every scenario are kept in
+# bench/work/results/<time>/.
+
+set -e
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+work=$bench_dir/work
+nginx=${NGINX:-$work/nginx/sbin/nginx}
+
+mode=${BENCH_MODE:-async}
+workers=${BENCH_WORKERS:-2}
+duration=${BENCH_DURATION:-30s}
+warmup=${BENCH_WARMUP:-5s}
+threads=${BENCH_THREADS:-4}
+connections=${BENCH_CONNECTIONS:-64}
+latency=${BENCH_LATENCY:-1}
+responders=${BENCH_RESPONDERS:-2}
+
+results=$work/results/$(date +%Y%m%d-%H%M%S)
+pids=
+
+if ! command -v wrk >/dev/null; then
+    # h2load would do for fixed credentials, but scenarios need a new user per request
+    echo "$0: wrk is needed, https://github.com/wg/wrk" >&2
+    exit 1
+fi
+
+if [ ! -x "$nginx" ]; then
+    echo "$0: $nginx not found, run bench/build.sh first" >&2
+    exit 1
+fi
+
+cleanup() {
+    for pid in $pids; do
+        kill "$pid" 2>/dev/null || true
+    done
+    for pid in $pids; do
+        wait "$pid" 2>/dev/null || true
+    done
+    pids=
+}
+
+trap cleanup EXIT
+trap 'cleanup; exit 1' INT TERM
+
+wait_port() {
+    python3 - "$1" <<'EOF'
+import socket, sys, time
+for _ in range(100):
+    try:
+        socket.create_connection(('127.0.0.1', int(sys.argv[1])), 0.1).close()
+        sys.exit(0)
+    except OSError:
+        time.sleep(0.1)
+sys.exit('port %s is not open' % sys.argv[1])
+EOF
+}
+
+responder() {
+    port=$1
+    shift
+    python3 "$bench_dir/ldap_responder.py" --listen "127.0.0.1:$port" --workers "$responders" "$@" \
+        2>>"$prefix/logs/ldap-$port.log" &
+    pids="$pids $!"
+    wait_port "$port"
+}
+
+start_nginx() {
+    mkdir -p "$prefix/conf" "$prefix/logs"
+    cp "$bench_dir/conf/nginx.conf" "$prefix/conf/nginx.conf"
+    cp "$bench_dir/conf/$1.conf" "$prefix/conf/scenario.conf"
+
+    echo "worker_processes $workers;" > "$prefix/conf/main.conf"
+    case $mode in
+        async)
+            echo "auth_ldap_async on;" > "$prefix/conf/mode.conf"
+            ;;
+        threads)
+            echo "thread_pool ldap threads=64 max_queue=65536;" >> "$prefix/conf/main.conf"
+            echo "auth_ldap_thread_pool ldap;" > "$prefix/conf/mode.conf"
+            ;;
+        sync)
+            : > "$prefix/conf/mode.conf"
+            ;;
+        *)
+            echo "$0: unknown BENCH_MODE $mode" >&2
+            exit 1
+            ;;
+    esac
+
+    "$nginx" -p "$prefix/" -c conf/nginx.conf -g "daemon off;" &
+    pids="$pids $!"
+    wait_port 8089
+}
+
+load() {
+    BENCH_USERS=$1 BENCH_PASSWORD=$2 BENCH_THREADS=$threads \
+        wrk -t"$threads" -c"$connections" -d"$3" --timeout 10s -s "$bench_dir/wrk.lua" http://127.0.0.1:8089/
+}
+
+scenario() {
+    name=$1
+    prefix=$results/$name
+    users=0
+    password=secret
+    warm=
+
+    mkdir -p "$prefix/logs"
+
+    case $name in
+        cold)
+            responder 3891 --latency "$latency"
+            start_nginx single
+            ;;
+        warm)
+            responder 3891 --latency "$latency"
+            start_nginx single
+            users=1000
+            warm=1
+            ;;
+        wrong-password)
+            responder 3891 --latency "$latency"
+            start_nginx single
+            users=1000
+            password=wrong
+            warm=1
+            ;;
+        groups)
+            responder 3891 --latency "$latency" --groups 20 --member-of -1
+            start_nginx groups
+            ;;
+        slow-first)
+            responder 3891 --latency 200
+            responder 3892 --latency "$latency"
+            start_nginx failover
+            ;;
+        dead-first)
+            responder 3891 --fail-rate 1 --fail-mode hang
+            responder 3892 --latency "$latency"
+            start_nginx failover
+            ;;
+        *)
+            echo "$0: unknown scenario $name" >&2
+            exit 1
+            ;;
+    esac
+
+    if [ -n "$warm" ]; then
+        load "$users" "$password" "$warmup" > "$prefix/warmup.txt"
+    fi
+
+    load "$users" "$password" "$duration" > "$prefix/wrk.txt"
+
+    if command -v curl >/dev/null; then
+        curl -s http://127.0.0.1:8090/auth_ldap_status > "$prefix/status.json" || true
+    fi
+
+    cleanup
+
+    sed -n "s/^bench: requests \([0-9]*\) rps \([0-9]*\) p50 \([^ ]*\) p99 \([^ ]*\) non2xx \([0-9]*\) errors \([0-9]*\)/$name \2 \3 \4 \5 \6/p" \
+        "$prefix/wrk.txt" | awk '{ printf "%-16s %10s %10s %10s %10s %8s\n", $1, $2, $3, $4, $5, $6 }' \
+        | tee -a "$results/summary.txt"
+}
+
+if [ $# -eq 0 ]; then
+    set -- cold warm wrong-password groups slow-first dead-first
+fi
+
+mkdir -p "$results"
+
+{
+    echo "mode $mode, $workers workers, wrk -t$threads -c$connections -d$duration, ldap latency ${latency}ms"
+    printf "%-16s %10s %10s %10s %10s %8s\n" scenario rps p50 p99 non-2xx errors
+} | tee "$results/summary.txt"
+
+for name in "$@"; do
+    scenario "$name"
+done
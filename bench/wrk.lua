@@ -0,0 +1,66 @@
+-- Basic credentials for wrk requests, set by run.sh through the environment:
+--
+--   BENCH_USERS     users are cycled through user0..user<N-1>, 0 - every request is a new user
+--   BENCH_PASSWORD  password of every request
+--   BENCH_THREADS   number of wrk threads (-t)
+--
+-- Prints one summary line with requests per second and latency percentiles.
+
+local users = tonumber(os.getenv("BENCH_USERS") or "1000")
+local password = os.getenv("BENCH_PASSWORD") or "secret"
+local step = tonumber(os.getenv("BENCH_THREADS") or "1")
+
+local chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+
+local function base64(s)
+    local out = {}
+    for i = 1, #s, 3 do
+        local a, b, c = s:byte(i, i + 2)
+        local n = a * 65536 + (b or 0) * 256 + (c or 0)
+        local c1, c2, c3, c4 = math.floor(n / 262144), math.floor(n / 4096) % 64, math.floor(n / 64) % 64, n % 64
+        out[#out + 1] = chars:sub(c1 + 1, c1 + 1) .. chars:sub(c2 + 1, c2 + 1)
+            .. (b and chars:sub(c3 + 1, c3 + 1) or "=") .. (c and chars:sub(c4 + 1, c4 + 1) or "=")
+    end
+    return table.concat(out)
+end
+
+local count = 0
+
+function setup(thread)
+    thread:set("id", count)
+    count = count + 1
+end
+
+local n
+local headers = {}
+
+function init(args)
+    -- threads take every step-th user, so they never send the same user at once
+    n = id
+end
+
+function request()
+    local user = n
+    if users > 0 then
+        user = n % users
+    end
+    n = n + step
+
+    local header = headers[user]
+    if header == nil then
+        header = "Basic " .. base64("user" .. user .. ":" .. password)
+        if users > 0 then
+            headers[user] = header
+        end
+    end
+
+    return wrk.format(nil, nil, { Authorization = header })
+end
+
+function done(summary, latency, requests)
+    local errors = summary.errors
+    io.write(string.format("bench: requests %d rps %.0f p50 %.2fms p99 %.2fms non2xx %d errors %d\n",
+        summary.requests, summary.requests / (summary.duration / 1000000),
+        latency:percentile(50) / 1000, latency:percentile(99) / 1000,
+        errors.status, errors.connect + errors.read + errors.write + errors.timeout))
+end
@@ -0,0 +1,518 @@
+/**
+ * Copyright (C) 2011-2013 Valery Komarov <komarov@valerka.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_auth_ldap_cache.h"
+
+
+static void ngx_http_auth_ldap_cache_flush(ngx_http_auth_ldap_cache_t *cache, uint32_t servers_crc);
+static void ngx_http_auth_ldap_rbtree_insert(ngx_rbtree_node_t *temp,
+       ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static int ngx_http_auth_ldap_rbtree_cmp(const ngx_rbtree_node_t *v_left,
+       const ngx_rbtree_node_t *v_right);
+static void ngx_rbtree_generic_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+       ngx_rbtree_node_t *sentinel, int (*compare)(const ngx_rbtree_node_t *left, const ngx_rbtree_node_t *right));
+static ngx_http_auth_ldap_node_t * ngx_http_auth_ldap_rbtree_lookup(ngx_rbtree_t *tree, ngx_rbtree_key_t hash,
+        ngx_uint_t kind, ngx_str_t *key);
+static ngx_uint_t nginx_http_auth_ldap_get_cache_key (ngx_uint_t kind, ngx_str_t *key);
+static ngx_int_t ngx_http_auth_ldap_cache_evict(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_log_t *log);
+static ngx_int_t ngx_http_auth_ldap_cache_evict_any(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_log_t *log);
+static void ngx_http_auth_ldap_cache_schedule(ngx_http_auth_ldap_cache_t *cache, ngx_http_auth_ldap_node_t *node);
+
+/**
+ * Init shared memory zone of the cache, records of inherited zone are dropped if servers_crc has changed
+ */
+ngx_int_t
+ngx_http_auth_ldap_cache_init(ngx_shm_zone_t *shm_zone, void *data, uint32_t servers_crc)
+{
+    ngx_http_auth_ldap_cache_t     *ocache = data;
+    ngx_http_auth_ldap_cache_t     *cache;
+    ngx_slab_pool_t                *shpool;
+    ngx_uint_t                     i;
+
+    cache = shm_zone->data;
+
+    // Zone is inherited from previous cycle on reload
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        ngx_http_auth_ldap_cache_flush(cache, servers_crc);
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    cache->shpool = shpool;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = shpool->data;
+        ngx_http_auth_ldap_cache_flush(cache, servers_crc);
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(shpool, sizeof(ngx_http_auth_ldap_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+    shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_http_auth_ldap_rbtree_insert);
+    for (i = 0; i < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; i++) {
+        ngx_queue_init(&cache->sh->records[i].lru);
+        ngx_queue_init(&cache->sh->records[i].expire_queue);
+        cache->sh->records[i].count = 0;
+    }
+    cache->sh->cleanup_lock = 0;
+    cache->sh->next_cleanup = 0;
+    cache->sh->servers_crc = servers_crc;
+    ngx_memzero(&cache->sh->stats, sizeof(ngx_http_auth_ldap_cache_stats_t));
+
+    return NGX_OK;
+}
+
+/**
+ * Drops all records of inherited zone if ldap_server list has changed
+ */
+static void
+ngx_http_auth_ldap_cache_flush(ngx_http_auth_ldap_cache_t *cache, uint32_t servers_crc)
+{
+    ngx_uint_t i;
+    ngx_queue_t *q;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (cache->sh->servers_crc != servers_crc) {
+        for (i = 0; i < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; i++) {
+            while (!ngx_queue_empty(&cache->sh->records[i].expire_queue)) {
+                q = ngx_queue_head(&cache->sh->records[i].expire_queue);
+                ngx_http_auth_ldap_cache_delete(cache, ngx_queue_data(q, ngx_http_auth_ldap_node_t, expire_queue));
+            }
+        }
+        cache->sh->servers_crc = servers_crc;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/**
+ * Insert new node into rbtree
+ */
+static void
+ngx_http_auth_ldap_rbtree_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+
+    ngx_rbtree_generic_insert(temp, node, sentinel, ngx_http_auth_ldap_rbtree_cmp);
+}
+
+/**
+ * Find cache node by hash, kind and key
+ */
+static ngx_http_auth_ldap_node_t *
+ngx_http_auth_ldap_rbtree_lookup(ngx_rbtree_t *tree, ngx_rbtree_key_t hash, ngx_uint_t kind, ngx_str_t *key)
+{
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_auth_ldap_node_t *cnode;
+    ngx_int_t rc;
+
+    node = tree->root;
+    sentinel = tree->sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key, hashes of different records might collide */
+        cnode = (ngx_http_auth_ldap_node_t *) node;
+        if (kind != cnode->kind) {
+            rc = kind < cnode->kind ? -1 : 1;
+        } else {
+            rc = ngx_memn2cmp(key->data, cnode->data, key->len, cnode->key_len);
+        }
+
+        if (rc == 0) {
+            return cnode;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/**
+ * Compares cache nodes in the same order as ngx_http_auth_ldap_rbtree_lookup
+ */
+static int
+ngx_http_auth_ldap_rbtree_cmp(const ngx_rbtree_node_t *v_left,
+    const ngx_rbtree_node_t *v_right)
+{
+    ngx_http_auth_ldap_node_t *left = (ngx_http_auth_ldap_node_t *) v_left;
+    ngx_http_auth_ldap_node_t *right = (ngx_http_auth_ldap_node_t *) v_right;
+
+    if (left->kind != right->kind) {
+        return left->kind < right->kind ? -1 : 1;
+    }
+
+    return ngx_memn2cmp(left->data, right->data, left->key_len, right->key_len);
+}
+
+/**
+ * Insert new node into rbtree
+ */
+static void
+ngx_rbtree_generic_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel,
+    int (*compare)(const ngx_rbtree_node_t *left, const ngx_rbtree_node_t *right))
+{
+    for ( ;; ) {
+        if (node->key < temp->key) {
+
+            if (temp->left == sentinel) {
+                temp->left = node;
+                break;
+            }
+
+            temp = temp->left;
+
+        } else if (node->key > temp->key) {
+
+            if (temp->right == sentinel) {
+                temp->right = node;
+                break;
+            }
+
+            temp = temp->right;
+
+        } else { /* node->key == temp->key */
+            if (compare(node, temp) < 0) {
+
+                if (temp->left == sentinel) {
+                    temp->left = node;
+                    break;
+                }
+
+                temp = temp->left;
+
+            } else {
+
+                if (temp->right == sentinel) {
+                    temp->right = node;
+                    break;
+                }
+
+                temp = temp->right;
+            }
+        }
+    }
+
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/**
+ * Removes records which are due from the heads of expiry queues, at most cleanup_batch of them.
+ * Returns NGX_AGAIN if the budget ran out before all due records were removed.
+ */
+ngx_int_t
+ngx_http_auth_ldap_cache_expire(ngx_http_auth_ldap_cache_t *cache, ngx_log_t *log)
+{
+    ngx_uint_t i, n;
+    ngx_queue_t *q, *expire_queue;
+    ngx_http_auth_ldap_node_t *node;
+    time_t now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    n = 0;
+    for (i = 0; i < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; i++) {
+        expire_queue = &cache->sh->records[i].expire_queue;
+
+        while (n < cache->cleanup_batch && !ngx_queue_empty(expire_queue)) {
+            q = ngx_queue_head(expire_queue);
+            node = ngx_queue_data(q, ngx_http_auth_ldap_node_t, expire_queue);
+
+            if (node->expires > now) {
+                break;
+            }
+
+            ngx_http_auth_ldap_cache_delete(cache, node);
+            n++;
+        }
+    }
+
+    ngx_atomic_fetch_add(&cache->sh->stats.expired, n);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "auth_ldap expired %ui records in zone \"%V\"",
+        n, &cache->shm_zone->shm.name);
+
+    return n == cache->cleanup_batch ? NGX_AGAIN : NGX_OK;
+}
+
+/**
+ * Returns simple hash key to use in rbtree
+ */
+static ngx_uint_t nginx_http_auth_ldap_get_cache_key (ngx_uint_t kind, ngx_str_t *key)
+{
+    uint32_t crc;
+    u_char k = (u_char) kind;
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, &k, 1);
+    ngx_crc32_update(&crc, key->data, key->len);
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+/**
+ * Removes record from cache if it is there
+ */
+void
+ngx_http_auth_ldap_cache_remove(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_str_t *key)
+{
+    ngx_http_auth_ldap_node_t *node;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_auth_ldap_rbtree_lookup(&cache->sh->rbtree, nginx_http_auth_ldap_get_cache_key(kind, key), kind, key);
+    if (node != NULL) {
+        ngx_http_auth_ldap_cache_delete(cache, node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/**
+ * Finds record which has not expired yet and marks it recently used, shm mutex must be held
+ */
+ngx_http_auth_ldap_node_t *
+ngx_http_auth_ldap_cache_find(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_str_t *key)
+{
+    ngx_http_auth_ldap_node_t *node;
+
+    node = ngx_http_auth_ldap_rbtree_lookup(&cache->sh->rbtree, nginx_http_auth_ldap_get_cache_key(kind, key), kind, key);
+
+    if (node == NULL || node->expires <= ngx_time()) {
+        return NULL;
+    }
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->records[kind].lru, &node->queue);
+
+    return node;
+}
+
+/**
+ * Stores record to cache, replaces existing record with the same key
+ */
+void
+ngx_http_auth_ldap_cache_put(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_str_t *key, ngx_str_t *value,
+    ngx_log_t *log)
+{
+    ngx_slab_pool_t *shpool = cache->shpool;
+    ngx_http_auth_ldap_records_t *records = &cache->sh->records[kind];
+    ngx_http_auth_ldap_node_t *node;
+    ngx_uint_t hash;
+    size_t size;
+
+    if (value->len > 0xffff) {
+        return;
+    }
+
+    size = offsetof(ngx_http_auth_ldap_node_t, data) + key->len + value->len;
+    hash = nginx_http_auth_ldap_get_cache_key(kind, key);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_http_auth_ldap_rbtree_lookup(&cache->sh->rbtree, hash, kind, key);
+    if (node != NULL && node->value_len != value->len) {
+        // new value does not fit into existing record
+        ngx_http_auth_ldap_cache_delete(cache, node);
+        node = NULL;
+    }
+
+    if (node != NULL) {
+        // Record is already there (e.g. it has expired, but was not removed yet), just refresh it
+        ngx_queue_remove(&node->queue);
+        ngx_queue_remove(&node->expire_queue);
+    } else {
+        if (cache->max_entries[kind] && records->count >= cache->max_entries[kind]) {
+            ngx_http_auth_ldap_cache_evict(cache, kind, log);
+        }
+
+        node = ngx_slab_alloc_locked(shpool, size);
+        while (node == NULL) {
+            if (ngx_http_auth_ldap_cache_evict_any(cache, kind, log) != NGX_OK) {
+                ngx_shmtx_unlock(&shpool->mutex);
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                            "auth_ldap ran out of shm space in zone \"%V\". Increase the zone size.", &cache->shm_zone->shm.name);
+                return;
+            }
+            node = ngx_slab_alloc_locked(shpool, size);
+        }
+
+        node->kind = (u_char) kind;
+        node->key_len = (u_short) key->len;
+        node->value_len = (u_short) value->len;
+        ngx_memcpy(node->data, key->data, key->len);
+        ((ngx_rbtree_node_t *)node)->key = hash;
+        ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+        records->count++;
+    }
+
+    ngx_memcpy(node->data + node->key_len, value->data, value->len);
+    ngx_queue_insert_head(&records->lru, &node->queue);
+    node->fresh_until = ngx_time() + cache->ttl[kind];
+    node->expires = node->fresh_until;
+    node->revalidate_until = 0;
+    if (kind == NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE) {
+        // stale record is kept for the longer of the grace periods
+        node->expires += ngx_max(cache->stale_revalidate, cache->stale_if_error);
+    }
+    ngx_http_auth_ldap_cache_schedule(cache, node);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+/**
+ * Removes least recently used record of the kind from cache, shm mutex must be held
+ */
+static ngx_int_t
+ngx_http_auth_ldap_cache_evict(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_log_t *log)
+{
+    ngx_queue_t *q;
+    ngx_http_auth_ldap_records_t *records = &cache->sh->records[kind];
+
+    if (ngx_queue_empty(&records->lru)) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_last(&records->lru);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "auth_ldap evicting cache record of kind %ui from zone \"%V\"",
+        kind, &cache->shm_zone->shm.name);
+
+    ngx_http_auth_ldap_cache_delete(cache, ngx_queue_data(q, ngx_http_auth_ldap_node_t, queue));
+    ngx_atomic_fetch_add(&cache->sh->stats.evictions, 1);
+
+    return NGX_OK;
+}
+
+/**
+ * Frees memory for new record of the kind when the zone is full, shm mutex must be held.
+ * Failed authentications go first and never push out other records.
+ */
+static ngx_int_t
+ngx_http_auth_ldap_cache_evict_any(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_log_t *log)
+{
+    ngx_uint_t k;
+
+    if (ngx_http_auth_ldap_cache_evict(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, log) == NGX_OK) {
+        return NGX_OK;
+    }
+
+    if (kind == NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_auth_ldap_cache_evict(cache, kind, log) == NGX_OK) {
+        return NGX_OK;
+    }
+
+    for (k = 0; k < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; k++) {
+        if (ngx_http_auth_ldap_cache_evict(cache, k, log) == NGX_OK) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+/**
+ * Inserts record into expiry queue, which is ordered by expiration time, shm mutex must be held
+ */
+static void
+ngx_http_auth_ldap_cache_schedule(ngx_http_auth_ldap_cache_t *cache, ngx_http_auth_ldap_node_t *node)
+{
+    ngx_queue_t *q, *expire_queue;
+    ngx_http_auth_ldap_node_t *prev;
+
+    expire_queue = &cache->sh->records[node->kind].expire_queue;
+
+    // new deadlines are almost always the latest ones, so search from the tail
+    for (q = ngx_queue_last(expire_queue);
+         q != ngx_queue_sentinel(expire_queue);
+         q = ngx_queue_prev(q))
+    {
+        prev = ngx_queue_data(q, ngx_http_auth_ldap_node_t, expire_queue);
+        if (prev->expires <= node->expires) {
+            break;
+        }
+    }
+
+    ngx_queue_insert_after(q, &node->expire_queue);
+}
+
+/**
+ * Removes record from cache and frees it, shm mutex must be held
+ */
+void
+ngx_http_auth_ldap_cache_delete(ngx_http_auth_ldap_cache_t *cache, ngx_http_auth_ldap_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+    ngx_queue_remove(&node->expire_queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->node);
+    cache->sh->records[node->kind].count--;
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+/**
+ * Hash of "username|password", credentials are hashed in place, so their length does not matter
+ */
+void
+ngx_http_auth_ldap_get_password_hash(const ngx_str_t *username, const ngx_str_t *password, u_char *hash)
+{
+    ngx_sha1_t sha1;
+
+    ngx_sha1_init(&sha1);
+    ngx_sha1_update(&sha1, username->data, username->len);
+    ngx_sha1_update(&sha1, "|", 1);
+    ngx_sha1_update(&sha1, password->data, password->len);
+    ngx_sha1_final(hash, &sha1);
+    hash[SHA_DIGEST_LENGTH] = '\0';
+}
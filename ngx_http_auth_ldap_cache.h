@@ -0,0 +1,128 @@
+/**
+ * Copyright (C) 2011-2013 Valery Komarov <komarov@valerka.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _NGX_HTTP_AUTH_LDAP_CACHE_H_INCLUDED_
+#define _NGX_HTTP_AUTH_LDAP_CACHE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_sha1.h>
+
+
+// password hash of cached credentials is SHA-1 digest
+#ifndef SHA_DIGEST_LENGTH
+#define SHA_DIGEST_LENGTH 20
+#endif
+
+typedef enum {
+    NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE = 0,  /* successful authentication, value is password hash */
+    NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE,      /* failed authentication, password hash is part of the key */
+    NGX_HTTP_AUTH_LDAP_CACHE_GROUP,         /* group compare result, value is 1 for member */
+    NGX_HTTP_AUTH_LDAP_CACHE_DN,            /* DN found by user search, value is the DN */
+    NGX_HTTP_AUTH_LDAP_CACHE_KINDS
+} ngx_http_auth_ldap_cache_kind_t;
+
+// queues of records of one kind in a cache zone
+typedef struct {
+    ngx_queue_t lru;                /* most recently used records first */
+    ngx_queue_t expire_queue;       /* records ordered by expiration time */
+    ngx_uint_t count;
+} ngx_http_auth_ldap_records_t;
+
+// lookups of user credentials and records removed from a cache zone
+typedef struct {
+    ngx_atomic_t hits;
+    ngx_atomic_t stale_hits;        /* expired record served while it is refreshed */
+    ngx_atomic_t negative_hits;
+    ngx_atomic_t misses;
+    ngx_atomic_t evictions;         /* records dropped to make room for new ones */
+    ngx_atomic_t expired;
+} ngx_http_auth_ldap_cache_stats_t;
+
+// shared part of a cache zone
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_http_auth_ldap_records_t records[NGX_HTTP_AUTH_LDAP_CACHE_KINDS];
+    ngx_atomic_t cleanup_lock;
+    ngx_msec_t next_cleanup;        /* when the zone is due for next expiry run */
+    uint32_t servers_crc;           /* ldap_server names records refer to by index */
+    ngx_http_auth_ldap_cache_stats_t stats;
+} ngx_http_auth_ldap_shctx_t;
+
+// cache zone, data of its shm_zone
+typedef struct {
+    ngx_http_auth_ldap_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_shm_zone_t *shm_zone;
+    void *data;                     /* owner of the zone, module keeps its main conf here */
+    time_t ttl[NGX_HTTP_AUTH_LDAP_CACHE_KINDS];             /* 0 disables caching of the kind */
+    ngx_uint_t max_entries[NGX_HTTP_AUTH_LDAP_CACHE_KINDS]; /* 0 means limited only by zone size */
+    ngx_uint_t cleanup_batch;       /* max number of records expired per run */
+    ngx_flag_t scope_addr;          /* records are valid only for the client address they were made for */
+    time_t stale_revalidate;        /* expired positive record is served while it is refreshed in background */
+    time_t stale_if_error;          /* expired positive record is served if no server answers */
+} ngx_http_auth_ldap_cache_t;
+
+// cache records in the rbtree, allocated with exact size of their key and value
+typedef struct {
+    ngx_rbtree_node_t node;    // the node's .key is crc32 of kind and key
+    ngx_queue_t       queue;   // link in LRU queue of its kind
+    ngx_queue_t       expire_queue; // link in expiry queue of its kind
+    time_t            expires; // time at which the node should be evicted
+    time_t            fresh_until; // positive record is served stale after it, until it expires
+    time_t            revalidate_until; // background refresh of stale record is in progress until then
+    u_char            kind;
+    u_short           key_len;
+    u_short           value_len;
+    u_char            data[1]; // key followed by value
+} ngx_http_auth_ldap_node_t;
+
+
+/*
+ * Shared memory cache of authentication results. Records are looked up by kind and key,
+ * are evicted in LRU order when the zone or max_entries of their kind is full, and are
+ * removed from deadline ordered queues once they expire. It depends only on nginx core,
+ * so it can be tested outside of a running nginx.
+ */
+
+ngx_int_t ngx_http_auth_ldap_cache_init(ngx_shm_zone_t *shm_zone, void *data, uint32_t servers_crc);
+
+// shm mutex must be held for find and delete, and while the found record is used
+ngx_http_auth_ldap_node_t *ngx_http_auth_ldap_cache_find(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind,
+    ngx_str_t *key);
+void ngx_http_auth_ldap_cache_delete(ngx_http_auth_ldap_cache_t *cache, ngx_http_auth_ldap_node_t *node);
+
+// these take the shm mutex themselves
+void ngx_http_auth_ldap_cache_put(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_str_t *key,
+    ngx_str_t *value, ngx_log_t *log);
+void ngx_http_auth_ldap_cache_remove(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_str_t *key);
+ngx_int_t ngx_http_auth_ldap_cache_expire(ngx_http_auth_ldap_cache_t *cache, ngx_log_t *log);
+void ngx_http_auth_ldap_get_password_hash(const ngx_str_t *username, const ngx_str_t *password, u_char *hash);
+
+
+#endif /* _NGX_HTTP_AUTH_LDAP_CACHE_H_INCLUDED_ */
@@ -29,6 +29,7 @@
 #include <ngx_http.h>
 #include <ngx_sha1.h>
 #include <ldap.h>
+#include "ngx_http_auth_ldap_cache.h"
 
 typedef struct {
     ngx_str_t username;
@@ -41,6 +42,33 @@ typedef struct {
     ngx_array_t *values;
 } ngx_ldap_require_t;
 
+typedef enum {
+    NGX_HTTP_AUTH_LDAP_OP_BIND = 0,         /* service and user bind */
+    NGX_HTTP_AUTH_LDAP_OP_SEARCH,
+    NGX_HTTP_AUTH_LDAP_OP_COMPARE,
+    NGX_HTTP_AUTH_LDAP_OPS
+} ngx_http_auth_ldap_op_t;
+
+// upper bounds of operation latency histogram buckets in milliseconds, the last one catches the rest
+#define NGX_HTTP_AUTH_LDAP_LATENCY_BUCKETS 11
+
+// operations sent to the server by all workers
+typedef struct {
+    ngx_atomic_t ops[NGX_HTTP_AUTH_LDAP_OPS];
+    ngx_atomic_t errors;            /* operations without result: timeout, connection failure */
+    ngx_atomic_t timeouts;
+    ngx_atomic_t latency[NGX_HTTP_AUTH_LDAP_LATENCY_BUCKETS];
+    ngx_atomic_t latency_sum;       /* milliseconds */
+} ngx_http_auth_ldap_server_stats_t;
+
+typedef struct {
+    ngx_uint_t fails;               /* failures in a row */
+    time_t open_until;              /* server is skipped until then */
+    time_t probe_until;             /* single request probes the server after open_until until then */
+    int last_error;                 /* LDAP error code of last failure */
+    ngx_http_auth_ldap_server_stats_t stats;
+} ngx_http_auth_ldap_health_t;
+
 typedef struct {
     LDAPURLDesc *ludpp;
     ngx_str_t url;
@@ -51,81 +79,317 @@ typedef struct {
 
     ngx_str_t group_attribute;
     ngx_flag_t group_attribute_dn;
+    ngx_str_t membership_attribute; /* user attribute listing groups (e.g. memberOf), empty to compare each group */
 
     ngx_array_t *require_group;     /* array of ngx_ldap_require_t */
     ngx_array_t *require_user;      /* array of ngx_ldap_require_t */
     ngx_flag_t require_valid_user;
     ngx_flag_t satisfy_all;
+
+    ngx_uint_t keepalive;           /* max number of idle connections kept per worker */
+    ngx_msec_t keepalive_timeout;
+    ngx_queue_t free_connections;   /* per worker pool of idle service-bound connections */
+    ngx_uint_t prewarm;             /* idle connections opened at worker start and kept open */
+    ngx_event_t prewarm_event;      /* per worker: opens missing connections one by one */
+
+    ngx_msec_t connect_timeout;
+    ngx_msec_t bind_timeout;        /* service and user bind */
+    ngx_msec_t search_timeout;
+    ngx_msec_t compare_timeout;
+
+    ngx_uint_t max_fails;           /* failures in a row which take server out of rotation, 0 disables */
+    time_t fail_timeout;            /* how long failed server is skipped before it is probed again */
+    ngx_http_auth_ldap_health_t *health; /* shared by all workers, in auth_ldap_health zone */
 } ngx_ldap_server;
 
 typedef struct {
     ngx_str_t realm;
-    ngx_array_t *servers;
+    ngx_array_t *servers;           /* array of ngx_str_t, server aliases from auth_ldap_servers */
+    ngx_array_t *ldap_servers;      /* array of ngx_ldap_server *, resolved from aliases at merge */
+    ngx_flag_t variable_requires;   /* some require rule of the servers uses variables */
+    ngx_shm_zone_t *cache_zone;     /* NULL if caching is off, unset where auth_ldap is off */
+    ngx_flag_t coalesce;            /* concurrent identical authentications wait for the first one */
+    ngx_flag_t hedge;               /* query further servers before the previous one answers */
+    ngx_msec_t hedge_delay;         /* 0 queries all servers at once */
+    ngx_uint_t status_format;       /* auth_ldap_status output, 0 if location is not status page */
 } ngx_http_auth_ldap_loc_conf_t;
 
 typedef struct {
     ngx_array_t *servers;     /* array of ngx_ldap_server */
-    ngx_hash_t srv;
+    ngx_flag_t async;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool; /* blocking LDAP calls are run there, NULL if not set */
+#endif
+    ngx_flag_t nonblocking;   /* request is suspended while waiting for LDAP server (async or thread pool) */
+    ngx_array_t *caches;      /* array of ngx_shm_zone_t *, all cache zones */
+    ngx_shm_zone_t *health_zone; /* health of servers, created if there are any servers */
 } ngx_http_auth_ldap_conf_t;
 
+typedef enum {
+    NGX_HTTP_AUTH_LDAP_PHASE_CONNECT,       /* open session to next server and send service bind */
+    NGX_HTTP_AUTH_LDAP_PHASE_SERVICE_BIND,  /* waiting for service bind result */
+    NGX_HTTP_AUTH_LDAP_PHASE_SEARCH,        /* waiting for user search result */
+    NGX_HTTP_AUTH_LDAP_PHASE_COMPARE,       /* waiting for group compare result */
+    NGX_HTTP_AUTH_LDAP_PHASE_USER_BIND,     /* waiting for user bind result */
+    NGX_HTTP_AUTH_LDAP_PHASE_FOLLOW,        /* waiting for identical authentication of another request */
+    NGX_HTTP_AUTH_LDAP_PHASE_DONE
+} ngx_http_auth_ldap_phase_t;
+
+typedef struct {
+    uint32_t servers_crc;           /* health is kept only for the same list of servers */
+    ngx_uint_t nservers;
+    ngx_http_auth_ldap_health_t servers[1];
+} ngx_http_auth_ldap_health_shctx_t;
+
+typedef struct ngx_http_auth_ldap_ctx_s ngx_http_auth_ldap_ctx_t;
+
+typedef struct {
+    LDAP *ld;
+    ngx_connection_t *conn;         /* libldap socket registered in nginx event loop (async mode only) */
+    ngx_ldap_server *server;
+    ngx_http_auth_ldap_ctx_t *rctx; /* request using the connection, NULL if it is in keepalive pool */
+    ngx_log_t *log;
+    ngx_queue_t queue;              /* link in server->free_connections */
+    ngx_msec_t idle_since;
+    int msgid;                      /* id of pending operation */
+    unsigned bind_pending:1;        /* service bind (or keepalive search) is sent, but result is not read yet */
+    unsigned user_bound:1;          /* bound as the user, needs service bind before reuse */
+    unsigned broken:1;              /* connection failed and must not be reused */
+    unsigned reused:1;              /* taken from keepalive pool */
+#if (NGX_THREADS)
+    ngx_thread_task_t *task;        /* waits for results in thread pool, allocated with the first operation */
+    unsigned task_busy:1;           /* ld is used by the task, connection is closed once it is over */
+#endif
+} ngx_http_auth_ldap_connection_t;
+
+#if (NGX_THREADS)
+// operation result read in thread pool
+typedef struct {
+    LDAP *ld;
+    int msgid;
+    struct timeval timeout;
+    LDAPMessage *result;
+    int rc;
+} ngx_http_auth_ldap_task_ctx_t;
+#endif
+
+// per request authentication state
+struct ngx_http_auth_ldap_ctx_s {
+    ngx_http_request_t *r;          /* NULL in background refresh */
+    ngx_pool_t *pool;               /* pool of the request, or own pool of background refresh */
+    ngx_log_t *log;
+    ngx_str_t addr;                 /* client address */
+    ngx_http_auth_ldap_loc_conf_t *conf;
+    ngx_http_auth_ldap_conf_t *mconf;
+    ngx_ldap_userinfo *uinfo;
+
+    ngx_uint_t server_index;
+    ngx_ldap_server *server;
+    ngx_http_auth_ldap_connection_t *lconn;
+
+    ngx_http_auth_ldap_phase_t phase;
+    LDAPMessage *result;            /* result of last operation, NULL if it failed */
+    int error;                      /* LDAP error code if there is no result */
+    char *dn;
+    struct berval group_value;
+    ngx_array_t *memberships;       /* ngx_str_t group DNs from membership_attribute of the user entry */
+    ngx_uint_t group_index;
+    ngx_flag_t pass;
+    ngx_int_t status;               /* access phase status once phase is DONE */
+    unsigned waiting:1;
+    unsigned fresh_connection:1;    /* do not take connection from keepalive pool */
+    unsigned failed:1;              /* server returned error, so its refusal is not cached */
+    unsigned group_cached:1;        /* compare result of current group is known without asking the server */
+    ngx_str_t group_key;            /* cache key of current group compare, empty if not cached */
+    unsigned dn_cached:1;           /* dn was taken from cache, so user search was skipped */
+    char *dn_refused;               /* cached dn the server refused, search checks if the user was moved */
+    unsigned op_timed:1;            /* operation was sent at op_start, its result is not counted yet */
+    ngx_msec_t op_start;
+
+    ngx_http_auth_ldap_ctx_t *main; /* ctx of the request, owns all hedged attempts */
+    ngx_http_auth_ldap_ctx_t *next; /* next hedged attempt of the same request */
+    ngx_uint_t next_server;         /* main only: index of the first server not taken by any attempt */
+    ngx_event_t hedge_timer;        /* main only: starts next attempt */
+    unsigned background:1;          /* main only: refresh of stale cache, not bound to any client request */
+    unsigned stale:1;               /* main only: stale positive record can be used if no server answers */
+    unsigned answered:1;            /* main only: some server has refused the credentials */
+
+    // main only: values of variables
+    ngx_uint_t cache_status;        /* $auth_ldap_cache_status, 0 if cache is off */
+    ngx_ldap_server *server_answered; /* $auth_ldap_server, last server which accepted or refused the user */
+    ngx_msec_t started;             /* $auth_ldap_time is counted from here until finished */
+    ngx_msec_t finished;
+    ngx_uint_t ops;                 /* $auth_ldap_ops, operations sent by all attempts */
+
+    ngx_http_auth_ldap_ctx_t *leader; /* request doing the same authentication, if following one */
+    ngx_queue_t flight;             /* link in worker's flights if leading, in leader's followers if following */
+    ngx_queue_t followers;          /* requests waiting for result of this one */
+    ngx_str_t flight_key;           /* servers, username and password hash, empty if not leading */
+    ngx_event_t wake_event;         /* resumes follower once leader is done */
+};
 
 
-// the shm segment that houses the used cache nodes tree
-static ngx_uint_t      ngx_http_auth_ldap_shm_size;
-static ngx_shm_zone_t *ngx_http_auth_ldap_shm_zone;
-static ngx_rbtree_t   *ngx_http_auth_ldap_rbtree;
-// nonce cleanup
+
+// default cache zone used by locations without auth_ldap_cache
+#define NGX_HTTP_AUTH_LDAP_CACHE_NAME "auth_ldap"
+#define NGX_HTTP_AUTH_LDAP_CACHE_SIZE (4 * 256 * ngx_pagesize)
+#define NGX_HTTP_AUTH_LDAP_CACHE_EXPIRE 300
+#define NGX_HTTP_AUTH_LDAP_NEGATIVE_MAX_ENTRIES 1024
+#define NGX_HTTP_AUTH_LDAP_GROUP_MAX_ENTRIES 16384
+#define NGX_HTTP_AUTH_LDAP_DN_MAX_ENTRIES 16384
+#define NGX_HTTP_AUTH_LDAP_REVALIDATE_TIMEOUT 60
+
+// stale positive record found by cache lookup
+#define NGX_HTTP_AUTH_LDAP_STALE_REVALIDATE 0x01
+#define NGX_HTTP_AUTH_LDAP_STALE_IF_ERROR 0x02
+#define NGX_HTTP_AUTH_LDAP_STALE_USED 0x04
+// values of $auth_ldap_cache_status
+#define NGX_HTTP_AUTH_LDAP_CACHE_MISS 1
+#define NGX_HTTP_AUTH_LDAP_CACHE_HIT 2
+#define NGX_HTTP_AUTH_LDAP_CACHE_STALE 3
+#define NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE_HIT 4
+// expiry of cache records: how often each zone is checked and default max number of records removed per run
 #define NGX_HTTP_AUTH_LDAP_CLEANUP_INTERVAL 3000
 #define NGX_HTTP_AUTH_LDAP_CLEANUP_BATCH_SIZE 2048
+// how long async request waits for LDAP server reply
+#define NGX_HTTP_AUTH_LDAP_OPERATION_TIMEOUT 10000
+#define NGX_HTTP_AUTH_LDAP_KEEPALIVE_TIMEOUT 60000
+// prewarmed connections of a server are opened within this many milliseconds
+#define NGX_HTTP_AUTH_LDAP_PREWARM_SPREAD 300
+#define NGX_HTTP_AUTH_LDAP_FAIL_TIMEOUT 10
+#define NGX_HTTP_AUTH_LDAP_HEALTH_NAME "auth_ldap_health"
+#define NGX_HTTP_AUTH_LDAP_STATUS_JSON 1
+#define NGX_HTTP_AUTH_LDAP_STATUS_PROMETHEUS 2
 ngx_event_t *ngx_http_auth_ldap_cleanup_timer;
-static ngx_array_t *ngx_http_auth_ldap_cleanup_list;
-static ngx_atomic_t *ngx_http_auth_ldap_cleanup_lock;
 
-// nonce entries in the rbtree
-typedef struct {
-    ngx_rbtree_node_t node;    // the node's .key is derived from the nonce val
-    time_t            expires; // time at which the node should be evicted
-    u_char username[100];
-    u_char password_hash[SHA_DIGEST_LENGTH+1];
-    u_char server_alias[100];
-    u_char client_ip[30];
-} ngx_http_auth_ldap_node_t;
+static ngx_msec_t ngx_http_auth_ldap_latency_buckets[NGX_HTTP_AUTH_LDAP_LATENCY_BUCKETS - 1] = {
+    5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+
+static char *ngx_http_auth_ldap_op_names[] = { "bind", "search", "compare" };
+static char *ngx_http_auth_ldap_record_names[] = { "positive", "negative", "group", "dn" };
+
+// Authentications in progress in this worker which other requests may wait for
+static ngx_queue_t ngx_http_auth_ldap_flights;
+
+// prefixes of auth_ldap_cache_zone ttl and max_entries parameters of each kind of cache records
+static ngx_str_t ngx_http_auth_ldap_cache_kind_names[] = {
+    ngx_string(""),
+    ngx_string("negative_"),
+    ngx_string("group_"),
+    ngx_string("dn_")
+};
 
 static void * ngx_http_auth_ldap_create_conf(ngx_conf_t *cf);
+static char * ngx_http_auth_ldap_init_main_conf(ngx_conf_t *cf, void *conf);
 static char * ngx_http_auth_ldap_ldap_server_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char * ngx_http_auth_ldap_parse_url(ngx_conf_t *cf, ngx_ldap_server *server);
 static char * ngx_http_auth_ldap_parse_require(ngx_conf_t *cf, ngx_ldap_server *server);
 static char * ngx_http_auth_ldap_parse_satisfy(ngx_conf_t *cf, ngx_ldap_server *server);
+static char * ngx_http_auth_ldap_parse_keepalive(ngx_conf_t *cf, ngx_ldap_server *server);
+static char * ngx_http_auth_ldap_parse_timeout(ngx_conf_t *cf, ngx_msec_t *timeout);
+static char * ngx_http_auth_ldap_parse_max_fails(ngx_conf_t *cf, ngx_ldap_server *server);
+static char * ngx_http_auth_ldap_parse_fail_timeout(ngx_conf_t *cf, ngx_ldap_server *server);
+static char * ngx_http_auth_ldap_parse_keepalive_timeout(ngx_conf_t *cf, ngx_ldap_server *server);
+static char * ngx_http_auth_ldap_parse_prewarm(ngx_conf_t *cf, ngx_ldap_server *server);
 static char * ngx_http_auth_ldap_ldap_server(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
 static ngx_int_t ngx_http_auth_ldap_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_auth_ldap_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_auth_ldap_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_auth_ldap_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static void * ngx_http_auth_basic_create_loc_conf(ngx_conf_t *);
+static char *ngx_http_auth_ldap_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_auth_ldap_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_auth_ldap_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_auth_ldap_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_auth_ldap_status_json(ngx_http_auth_ldap_conf_t *mconf, u_char *p, u_char *last);
+static u_char *ngx_http_auth_ldap_status_prometheus(ngx_http_auth_ldap_conf_t *mconf, u_char *p, u_char *last);
+static const char *ngx_http_auth_ldap_server_state(ngx_ldap_server *server);
+static u_char *ngx_http_auth_ldap_status_escape(u_char *p, u_char *last, ngx_str_t *str);
+static void ngx_http_auth_ldap_op_stats(ngx_http_auth_ldap_ctx_t *ctx);
+static ngx_flag_t ngx_http_auth_ldap_require_variables(ngx_array_t *requires);
+static char *ngx_http_auth_ldap_resolve_servers(ngx_conf_t *cf, ngx_http_auth_ldap_loc_conf_t *conf);
 static char * ngx_http_auth_ldap_merge_loc_conf(ngx_conf_t *, void *, void *);
-static ngx_int_t ngx_http_auth_ldap_authenticate_against_server(ngx_http_request_t *r, ngx_ldap_server *server,
-        ngx_ldap_userinfo *uinfo, ngx_http_auth_ldap_loc_conf_t *conf);
+static ngx_int_t ngx_http_auth_ldap_process(ngx_http_auth_ldap_ctx_t *ctx);
+static ngx_int_t ngx_http_auth_ldap_process_all(ngx_http_auth_ldap_ctx_t *main);
+static ngx_int_t ngx_http_auth_ldap_join_flight(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_land_flight(ngx_http_auth_ldap_ctx_t *leader, ngx_int_t status);
+static void ngx_http_auth_ldap_wake_handler(ngx_event_t *ev);
+static ngx_http_auth_ldap_ctx_t *ngx_http_auth_ldap_add_attempt(ngx_http_auth_ldap_ctx_t *main);
+static void ngx_http_auth_ldap_hedge_handler(ngx_event_t *ev);
+static void ngx_http_auth_ldap_connect(ngx_http_auth_ldap_ctx_t *ctx);
+static int ngx_http_auth_ldap_service_bind(ngx_http_auth_ldap_connection_t *lconn);
+static void ngx_http_auth_ldap_service_bind_done(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_search_user(ngx_http_auth_ldap_ctx_t *ctx);
+static int ngx_http_auth_ldap_search(ngx_http_auth_ldap_ctx_t *ctx, u_char *filter);
+static void ngx_http_auth_ldap_search_done(ngx_http_auth_ldap_ctx_t *ctx);
+static ngx_int_t ngx_http_auth_ldap_get_memberships(ngx_http_auth_ldap_ctx_t *ctx, LDAPMessage *entry);
+static void ngx_http_auth_ldap_check_requirements(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_check_group(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_compare_done(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_check_user_bind(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_user_bind_done(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_server_done(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_next_server(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_finish(ngx_http_auth_ldap_ctx_t *ctx, ngx_int_t status);
+static int ngx_http_auth_ldap_result_code(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_wait_result(ngx_http_auth_ldap_ctx_t *ctx, ngx_msec_t timeout);
+static void ngx_http_auth_ldap_result_done(ngx_http_auth_ldap_ctx_t *ctx, int rc, LDAPMessage *result);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_auth_ldap_post_task(ngx_http_auth_ldap_ctx_t *ctx, ngx_msec_t timeout);
+static void ngx_http_auth_ldap_task_handler(void *data, ngx_log_t *log);
+static void ngx_http_auth_ldap_task_done(ngx_event_t *ev);
+#endif
+static void ngx_http_auth_ldap_msec_to_timeval(ngx_msec_t ms, struct timeval *tv);
+static ngx_int_t ngx_http_auth_ldap_add_connection(ngx_http_auth_ldap_connection_t *lconn);
+static void ngx_http_auth_ldap_read_handler(ngx_event_t *rev);
+static void ngx_http_auth_ldap_write_handler(ngx_event_t *wev);
+static void ngx_http_auth_ldap_idle_handler(ngx_http_auth_ldap_connection_t *lconn);
+static ngx_int_t ngx_http_auth_ldap_keep_warm(ngx_http_auth_ldap_connection_t *lconn);
+static ngx_http_auth_ldap_connection_t *ngx_http_auth_ldap_open_connection(ngx_ldap_server *server,
+        ngx_http_auth_ldap_conf_t *mconf, ngx_log_t *log);
+static void ngx_http_auth_ldap_prewarm_handler(ngx_event_t *ev);
+static ngx_uint_t ngx_http_auth_ldap_free_connections(ngx_ldap_server *server);
+static void ngx_http_auth_ldap_wake_request(ngx_http_request_t *r);
+static void ngx_http_auth_ldap_resume(ngx_http_auth_ldap_ctx_t *ctx);
+static ngx_int_t ngx_http_auth_ldap_revalidate(ngx_http_request_t *r, ngx_http_auth_ldap_loc_conf_t *conf,
+        ngx_http_auth_ldap_conf_t *mconf, ngx_ldap_userinfo *uinfo);
+static ngx_http_auth_ldap_connection_t * ngx_http_auth_ldap_get_cached_connection(ngx_ldap_server *server, ngx_log_t *log);
+static void ngx_http_auth_ldap_release_connection(ngx_http_auth_ldap_ctx_t *ctx, ngx_flag_t keep);
+static void ngx_http_auth_ldap_close_connection(ngx_http_auth_ldap_connection_t *lconn);
+static void ngx_http_auth_ldap_ctx_cleanup(void *data);
 static ngx_int_t ngx_http_auth_ldap_set_realm(ngx_http_request_t *r, ngx_str_t *realm);
 static ngx_ldap_userinfo * ngx_http_auth_ldap_get_user_info(ngx_http_request_t *);
 static ngx_int_t ngx_http_auth_ldap_authenticate(ngx_http_request_t *r, ngx_http_auth_ldap_loc_conf_t *conf,
         ngx_http_auth_ldap_conf_t *mconf);
 static char * ngx_http_auth_ldap(ngx_conf_t *cf, void *post, void *data);
 static ngx_conf_post_handler_pt ngx_http_auth_ldap_p = ngx_http_auth_ldap;
+static char * ngx_http_auth_ldap_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_http_auth_ldap_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_shm_zone_t * ngx_http_auth_ldap_find_cache(ngx_conf_t *cf, ngx_str_t *name);
+static ngx_shm_zone_t * ngx_http_auth_ldap_add_cache(ngx_conf_t *cf, ngx_str_t *name, size_t size);
+static uint32_t ngx_http_auth_ldap_servers_crc(ngx_http_auth_ldap_conf_t *mconf);
+static ngx_int_t ngx_http_auth_ldap_init_health_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_flag_t ngx_http_auth_ldap_server_available(ngx_http_auth_ldap_ctx_t *ctx, ngx_ldap_server *server);
+static void ngx_http_auth_ldap_server_health(ngx_http_auth_ldap_ctx_t *ctx, ngx_ldap_server *server, ngx_flag_t failed,
+    int error);
 static ngx_int_t ngx_http_auth_ldap_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data);
-static void ngx_http_auth_ldap_rbtree_insert(ngx_rbtree_node_t *temp,
-       ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
-static int ngx_http_auth_ldap_rbtree_cmp(const ngx_rbtree_node_t *v_left,
-       const ngx_rbtree_node_t *v_right);
-static void ngx_rbtree_generic_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
-       ngx_rbtree_node_t *sentinel, int (*compare)(const ngx_rbtree_node_t *left, const ngx_rbtree_node_t *right));
 void ngx_http_auth_ldap_cleanup(ngx_event_t *ev);
 static ngx_int_t ngx_http_auth_ldap_worker_init(ngx_cycle_t *cycle);
-static void ngx_http_auth_ldap_rbtree_prune(ngx_log_t *log);
-static void ngx_http_auth_ldap_rbtree_prune_walk(ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel, time_t now, ngx_log_t *log);
-static ngx_http_auth_ldap_node_t ngx_http_auth_ldap_cache_store(ngx_http_request_t *r, ngx_ldap_userinfo *uinfo, ngx_ldap_server *server);
-static ngx_rbtree_node_t * ngx_http_auth_ldap_rbtree_find(ngx_rbtree_key_t key, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
-static ngx_uint_t nginx_http_auth_ldap_get_cache_key (ngx_ldap_userinfo *uinfo);
-//static ngx_str_t ngx_http_auth_ldap_get_password_hash (ngx_str_t *username, ngx_str_t *password);
-//static void ngx_http_auth_ldap_get_password_hash (const ngx_str_t *username, const ngx_str_t *password, ngx_str_t *hash);
-static void ngx_http_auth_ldap_get_password_hash (ngx_http_request_t *r, const ngx_str_t *username, const ngx_str_t *password, u_char *hash);
+static ngx_int_t ngx_http_auth_ldap_dn_key(ngx_http_auth_ldap_ctx_t *ctx, ngx_str_t *key);
+static ngx_int_t ngx_http_auth_ldap_lookup_dn(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_store_dn(ngx_http_auth_ldap_ctx_t *ctx);
+static void ngx_http_auth_ldap_remove_dn(ngx_http_auth_ldap_ctx_t *ctx);
+static ngx_int_t ngx_http_auth_ldap_cache_lookup(ngx_http_request_t *r, ngx_http_auth_ldap_cache_t *cache,
+        ngx_http_auth_ldap_loc_conf_t *conf, ngx_http_auth_ldap_conf_t *mconf, ngx_ldap_userinfo *uinfo, ngx_uint_t *stale,
+        ngx_ldap_server **server);
+static void ngx_http_auth_ldap_cache_forget(ngx_http_auth_ldap_ctx_t *ctx, ngx_http_auth_ldap_cache_t *cache,
+        ngx_http_auth_ldap_loc_conf_t *conf, ngx_ldap_userinfo *uinfo);
+static void ngx_http_auth_ldap_cache_store(ngx_http_auth_ldap_ctx_t *ctx, ngx_http_auth_ldap_cache_t *cache, ngx_ldap_userinfo *uinfo,
+        ngx_ldap_server *server, ngx_flag_t negative);
+static void ngx_http_auth_ldap_cache_scope(ngx_str_t *addr, ngx_http_auth_ldap_cache_t *cache, ngx_str_t *scope);
+static ngx_int_t ngx_http_auth_ldap_cache_key(ngx_pool_t *pool, ngx_http_auth_ldap_cache_t *cache, ngx_ldap_server *server,
+        ngx_str_t *parts, ngx_uint_t n, ngx_str_t *key);
 
 static ngx_command_t ngx_http_auth_ldap_commands[] = {
     {
@@ -152,20 +416,103 @@ static ngx_command_t ngx_http_auth_ldap_commands[] = {
         offsetof(ngx_http_auth_ldap_loc_conf_t, servers),
         NULL
     },
+    {
+        ngx_string("auth_ldap_async"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_auth_ldap_conf_t, async),
+        NULL
+    },
+    {
+        ngx_string("auth_ldap_thread_pool"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_http_auth_ldap_thread_pool,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("auth_ldap_cache_zone"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+        ngx_http_auth_ldap_cache_zone,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("auth_ldap_cache"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LMT_CONF | NGX_CONF_TAKE1,
+        ngx_http_auth_ldap_cache,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("auth_ldap_coalesce"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LMT_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_auth_ldap_loc_conf_t, coalesce),
+        NULL
+    },
+    {
+        ngx_string("auth_ldap_hedge"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LMT_CONF | NGX_CONF_TAKE1,
+        ngx_http_auth_ldap_hedge,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("auth_ldap_status"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+        ngx_http_auth_ldap_status,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
     ngx_null_command
 };
 
 static ngx_http_module_t ngx_http_auth_ldap_module_ctx = {
-    NULL, /* preconfiguration */
+    ngx_http_auth_ldap_add_variables, /* preconfiguration */
     ngx_http_auth_ldap_init, /* postconfiguration */
     ngx_http_auth_ldap_create_conf, /* create main configuration */
-    NULL, /* init main configuration */
+    ngx_http_auth_ldap_init_main_conf, /* init main configuration */
     NULL, //ngx_http_auth_ldap_create_server_conf, /* create server configuration */
     NULL, //ngx_http_auth_ldap_merge_server_conf, /* merge server configuration */
     ngx_http_auth_basic_create_loc_conf, /* create location configuration */
     ngx_http_auth_ldap_merge_loc_conf /* merge location configuration */
 };
 
+// values of ngx_http_auth_ldap_vars data
+#define NGX_HTTP_AUTH_LDAP_VAR_CACHE_STATUS 0
+#define NGX_HTTP_AUTH_LDAP_VAR_SERVER 1
+#define NGX_HTTP_AUTH_LDAP_VAR_TIME 2
+#define NGX_HTTP_AUTH_LDAP_VAR_OPS 3
+
+static ngx_http_variable_t ngx_http_auth_ldap_vars[] = {
+    { ngx_string("auth_ldap_cache_status"), NULL, ngx_http_auth_ldap_variable,
+      NGX_HTTP_AUTH_LDAP_VAR_CACHE_STATUS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("auth_ldap_server"), NULL, ngx_http_auth_ldap_variable,
+      NGX_HTTP_AUTH_LDAP_VAR_SERVER, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("auth_ldap_time"), NULL, ngx_http_auth_ldap_variable,
+      NGX_HTTP_AUTH_LDAP_VAR_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("auth_ldap_ops"), NULL, ngx_http_auth_ldap_variable,
+      NGX_HTTP_AUTH_LDAP_VAR_OPS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+// indexed by cache_status of ctx
+static ngx_str_t ngx_http_auth_ldap_cache_statuses[] = {
+    ngx_null_string,
+    ngx_string("MISS"),
+    ngx_string("HIT"),
+    ngx_string("STALE"),
+    ngx_string("NEGATIVE")
+};
+
 ngx_module_t ngx_http_auth_ldap_module = {
     NGX_MODULE_V1,
     &ngx_http_auth_ldap_module_ctx, /* module context */
@@ -214,7 +561,17 @@ ngx_http_auth_ldap_ldap_server_block(ngx_conf_t *cf, ngx_command_t *cmd, void *c
     if (s == NULL) {
         return NGX_CONF_ERROR;
     }
+    ngx_memzero(s, sizeof(ngx_ldap_server));
     s->alias = name;
+    s->keepalive = NGX_CONF_UNSET_UINT;
+    s->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    s->max_fails = NGX_CONF_UNSET_UINT;
+    s->fail_timeout = NGX_CONF_UNSET;
+    s->connect_timeout = NGX_CONF_UNSET_MSEC;
+    s->bind_timeout = NGX_CONF_UNSET_MSEC;
+    s->search_timeout = NGX_CONF_UNSET_MSEC;
+    s->compare_timeout = NGX_CONF_UNSET_MSEC;
+    s->prewarm = NGX_CONF_UNSET_UINT;
 
     save = *cf;
     cf->handler = ngx_http_auth_ldap_ldap_server;
@@ -226,6 +583,22 @@ ngx_http_auth_ldap_ldap_server_block(ngx_conf_t *cf, ngx_command_t *cmd, void *c
         return rv;
     }
 
+    ngx_conf_init_uint_value(s->keepalive, 0);
+    ngx_conf_init_uint_value(s->prewarm, 0);
+    ngx_conf_init_msec_value(s->keepalive_timeout, NGX_HTTP_AUTH_LDAP_KEEPALIVE_TIMEOUT);
+    ngx_conf_init_uint_value(s->max_fails, 0);
+    ngx_conf_init_value(s->fail_timeout, NGX_HTTP_AUTH_LDAP_FAIL_TIMEOUT);
+    ngx_conf_init_msec_value(s->connect_timeout, NGX_HTTP_AUTH_LDAP_OPERATION_TIMEOUT);
+    ngx_conf_init_msec_value(s->bind_timeout, NGX_HTTP_AUTH_LDAP_OPERATION_TIMEOUT);
+    ngx_conf_init_msec_value(s->search_timeout, NGX_HTTP_AUTH_LDAP_OPERATION_TIMEOUT);
+    ngx_conf_init_msec_value(s->compare_timeout, NGX_HTTP_AUTH_LDAP_OPERATION_TIMEOUT);
+    ngx_queue_init(&s->free_connections);
+
+    if (s->prewarm > s->keepalive) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "LDAP server \"%V\": prewarm can't be greater than keepalive", &s->alias);
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -257,10 +630,30 @@ ngx_http_auth_ldap_ldap_server(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
         server->group_attribute = value[1];
     } else if(ngx_strcmp(value[0].data, "group_attribute_is_dn") == 0 && ngx_strcmp(value[1].data, "on")) {
         server->group_attribute_dn = 1;
+    } else if(ngx_strcmp(value[0].data, "membership_attribute") == 0) {
+        server->membership_attribute = value[1];
     } else if(ngx_strcmp(value[0].data, "require") == 0) {
         return ngx_http_auth_ldap_parse_require(cf, server);
     } else if(ngx_strcmp(value[0].data, "satisfy") == 0) {
         return ngx_http_auth_ldap_parse_satisfy(cf, server);
+    } else if(ngx_strcmp(value[0].data, "keepalive") == 0) {
+        return ngx_http_auth_ldap_parse_keepalive(cf, server);
+    } else if(ngx_strcmp(value[0].data, "keepalive_timeout") == 0) {
+        return ngx_http_auth_ldap_parse_keepalive_timeout(cf, server);
+    } else if(ngx_strcmp(value[0].data, "prewarm") == 0) {
+        return ngx_http_auth_ldap_parse_prewarm(cf, server);
+    } else if(ngx_strcmp(value[0].data, "connect_timeout") == 0) {
+        return ngx_http_auth_ldap_parse_timeout(cf, &server->connect_timeout);
+    } else if(ngx_strcmp(value[0].data, "bind_timeout") == 0) {
+        return ngx_http_auth_ldap_parse_timeout(cf, &server->bind_timeout);
+    } else if(ngx_strcmp(value[0].data, "search_timeout") == 0) {
+        return ngx_http_auth_ldap_parse_timeout(cf, &server->search_timeout);
+    } else if(ngx_strcmp(value[0].data, "compare_timeout") == 0) {
+        return ngx_http_auth_ldap_parse_timeout(cf, &server->compare_timeout);
+    } else if(ngx_strcmp(value[0].data, "max_fails") == 0) {
+        return ngx_http_auth_ldap_parse_max_fails(cf, server);
+    } else if(ngx_strcmp(value[0].data, "fail_timeout") == 0) {
+        return ngx_http_auth_ldap_parse_fail_timeout(cf, server);
     }
 
     rv = NGX_CONF_OK;
@@ -466,729 +859,3612 @@ ngx_http_auth_ldap_parse_satisfy(ngx_conf_t *cf, ngx_ldap_server *server) {
 }
 
 /**
- * Create main config which will store ldap_servers array
+ * Parse "keepalive" conf parameter
  */
-static void *
-ngx_http_auth_ldap_create_conf(ngx_conf_t *cf)
-{
-    ngx_http_auth_ldap_conf_t  *conf;
+static char *
+ngx_http_auth_ldap_parse_keepalive(ngx_conf_t *cf, ngx_ldap_server *server) {
+    ngx_str_t *value;
+    ngx_int_t n;
+    value = cf->args->elts;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_ldap_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Incorrect value for keepalive: %V", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    return conf;
+    server->keepalive = n;
+    return NGX_CONF_OK;
 }
 
 /**
- * Create location conf
+ * Parse "keepalive_timeout" conf parameter
  */
-static void *
-ngx_http_auth_basic_create_loc_conf(ngx_conf_t *cf) {
-    ngx_http_auth_ldap_loc_conf_t *conf;
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_ldap_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
+static char *
+ngx_http_auth_ldap_parse_keepalive_timeout(ngx_conf_t *cf, ngx_ldap_server *server) {
+    ngx_str_t *value;
+    ngx_int_t n;
+    value = cf->args->elts;
+
+    n = ngx_parse_time(&value[1], 0);
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Incorrect value for keepalive_timeout: %V", &value[1]);
+        return NGX_CONF_ERROR;
     }
-    conf->servers = NGX_CONF_UNSET_PTR;
 
-    return conf;
+    server->keepalive_timeout = n;
+    return NGX_CONF_OK;
 }
 
 /**
- * Merge location conf
+ * Parse "prewarm" conf parameter
  */
 static char *
-ngx_http_auth_ldap_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
-    ngx_http_auth_ldap_loc_conf_t *prev = parent;
-    ngx_http_auth_ldap_loc_conf_t *conf = child;
+ngx_http_auth_ldap_parse_prewarm(ngx_conf_t *cf, ngx_ldap_server *server) {
+    ngx_str_t *value;
+    ngx_int_t n;
+    value = cf->args->elts;
 
-    if (conf->realm.data == NULL) {
-        conf->realm = prev->realm;
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Incorrect value for prewarm: %V", &value[1]);
+        return NGX_CONF_ERROR;
     }
-    ngx_conf_merge_ptr_value(conf->servers, prev->servers, NULL);
 
+    server->prewarm = n;
     return NGX_CONF_OK;
 }
 
 /**
- * LDAP Authentication handler
+ * Parse connect, bind, search and compare timeouts
  */
-static ngx_int_t ngx_http_auth_ldap_handler(ngx_http_request_t *r) {
-    int rc;
-    ngx_http_auth_ldap_loc_conf_t *alcf;
-
-    alcf = ngx_http_get_module_loc_conf(r, ngx_http_auth_ldap_module);
+static char *
+ngx_http_auth_ldap_parse_timeout(ngx_conf_t *cf, ngx_msec_t *timeout) {
+    ngx_str_t *value;
+    ngx_msec_t n;
+    value = cf->args->elts;
 
-    if (alcf->realm.len == 0) {
-        return NGX_DECLINED;
+    n = ngx_parse_time(&value[1], 0);
+    if (n == (ngx_msec_t) NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Incorrect value for %V: %V", &value[0], &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    ngx_http_auth_ldap_conf_t  *cnf;
-
-    cnf = ngx_http_get_module_main_conf(r, ngx_http_auth_ldap_module);
+    *timeout = n;
+    return NGX_CONF_OK;
+}
 
-    rc = ngx_http_auth_basic_user(r);
+/**
+ * Parse "max_fails" conf parameter
+ */
+static char *
+ngx_http_auth_ldap_parse_max_fails(ngx_conf_t *cf, ngx_ldap_server *server) {
+    ngx_str_t *value;
+    ngx_int_t n;
+    value = cf->args->elts;
 
-    if (rc == NGX_DECLINED) {
-        return ngx_http_auth_ldap_set_realm(r, &alcf->realm);
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Incorrect value for max_fails: %V", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    if (rc == NGX_ERROR) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    server->max_fails = n;
+    return NGX_CONF_OK;
+}
+
+/**
+ * Parse "fail_timeout" conf parameter
+ */
+static char *
+ngx_http_auth_ldap_parse_fail_timeout(ngx_conf_t *cf, ngx_ldap_server *server) {
+    ngx_str_t *value;
+    time_t n;
+    value = cf->args->elts;
+
+    n = ngx_parse_time(&value[1], 1);
+    if (n == (time_t) NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Incorrect value for fail_timeout: %V", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    return ngx_http_auth_ldap_authenticate(r, alcf, cnf);
+    server->fail_timeout = n;
+    return NGX_CONF_OK;
 }
 
 /**
- * Get login and password from http request.
+ * Create main config which will store ldap_servers array
  */
-static ngx_ldap_userinfo*
-ngx_http_auth_ldap_get_user_info(ngx_http_request_t *r) {
-    size_t len;
-    ngx_ldap_userinfo* uinfo;
-    u_char *uname_buf, *p;
-
-    uinfo = ngx_palloc(r->pool, sizeof(ngx_ldap_userinfo));
+static void *
+ngx_http_auth_ldap_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_auth_ldap_conf_t  *conf;
 
-    for (len = 0; len < r->headers_in.user.len; len++) {
-        if (r->headers_in.user.data[len] == ':') {
-            break;
-        }
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_ldap_conf_t));
+    if (conf == NULL) {
+        return NULL;
     }
+    conf->async = NGX_CONF_UNSET;
 
-    uname_buf = ngx_palloc(r->pool, len + 1);
-    if (uname_buf == NULL) {
+    conf->caches = ngx_array_create(cf->pool, 2, sizeof(ngx_shm_zone_t *));
+    if (conf->caches == NULL) {
         return NULL;
     }
-    p = ngx_cpymem(uname_buf, r->headers_in.user.data, len);
-    *p = '\0';
-
-    uinfo->username.data = uname_buf;
-    uinfo->username.len = len;
-    uinfo->password.data = r->headers_in.passwd.data;
-    uinfo->password.len = r->headers_in.passwd.len;
 
-    return uinfo;
+    return conf;
 }
 
 /**
- * Read user credentials from request, set LDAP parameters and call authentication against required servers
+ * Init main config
  */
-static ngx_int_t ngx_http_auth_ldap_authenticate(ngx_http_request_t *r, ngx_http_auth_ldap_loc_conf_t *conf,
-        ngx_http_auth_ldap_conf_t *mconf) {
-
-    ngx_ldap_server *server, *servers;
-    servers = mconf->servers->elts;
+static char *
+ngx_http_auth_ldap_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_auth_ldap_conf_t *cnf = conf;
+    ngx_str_t name = ngx_string(NGX_HTTP_AUTH_LDAP_HEALTH_NAME);
+    int reqcert = LDAP_OPT_X_TLS_ALLOW;
+    size_t size;
     int rc;
-    ngx_uint_t i, k;
-    ngx_str_t *alias;
 
-    int version = LDAP_VERSION3;
-    int reqcert = LDAP_OPT_X_TLS_ALLOW;
-    ngx_ldap_userinfo *uinfo;
-    struct timeval timeOut = { 10, 0 };
-    ngx_flag_t pass = NGX_CONF_UNSET;
+    ngx_conf_init_value(cnf->async, 0);
 
-    uinfo = ngx_http_auth_ldap_get_user_info(r);
+#if (NGX_THREADS)
+    if (cnf->async && cnf->thread_pool != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"auth_ldap_thread_pool\" can't be used with \"auth_ldap_async on\"");
+        return NGX_CONF_ERROR;
+    }
+    cnf->nonblocking = cnf->async || cnf->thread_pool != NULL;
+#else
+    cnf->nonblocking = cnf->async;
+#endif
 
-    if (uinfo == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    // TLS options are global in libldap, they are set once here and inherited by workers
+    rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_REQUIRE_CERT, &reqcert);
+    if (rc != LDAP_OPT_SUCCESS) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "LDAP: unable to set require cert option: %s", ldap_err2string(rc));
     }
 
-    if (uinfo->password.len == 0)
-    {
-        return ngx_http_auth_ldap_set_realm(r, &conf->realm);
+    if (cnf->servers == NULL) {
+        return NGX_CONF_OK;
     }
 
-    ngx_slab_pool_t                        *shpool;
-    ngx_uint_t                             key;
+    size = 8 * ngx_pagesize + ngx_align(cnf->servers->nelts * sizeof(ngx_http_auth_ldap_health_t), ngx_pagesize);
 
-    shpool = (ngx_slab_pool_t *)ngx_http_auth_ldap_shm_zone->shm.addr;
+    cnf->health_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_auth_ldap_module);
+    if (cnf->health_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    key = nginx_http_auth_ldap_get_cache_key(uinfo);
+    cnf->health_zone->init = ngx_http_auth_ldap_init_health_zone;
+    cnf->health_zone->data = cnf;
 
-    ngx_shmtx_lock(&shpool->mutex);
-	ngx_http_auth_ldap_node_t *cached_credentials = (ngx_http_auth_ldap_node_t *)ngx_http_auth_ldap_rbtree_find(
-			key, ngx_http_auth_ldap_rbtree->root, ngx_http_auth_ldap_rbtree->sentinel);
-	ngx_shmtx_unlock(&shpool->mutex);
-
-	if (cached_credentials != NULL) {
-		if (ngx_strncmp(uinfo->username.data, cached_credentials->username, uinfo->username.len) == 0) {
-
-			// Check that client ip is same first
-			if (ngx_strncmp(r->connection->addr_text.data, cached_credentials->client_ip, r->connection->addr_text.len) == 0) {
-
-				unsigned char hash[SHA_DIGEST_LENGTH];
-				ngx_http_auth_ldap_get_password_hash(r, &uinfo->username, &uinfo->password, hash);
-				ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Comparing password hashes: %s == %s", hash, cached_credentials->password_hash);
-
-				if (ngx_strncmp(hash, cached_credentials->password_hash, SHA_DIGEST_LENGTH) == 0) {
-					int alias_found = 0;
-					for (k = 0; k < conf->servers->nelts; k++) {
-			            server = &servers[k];
-			            if (ngx_strncmp(server->alias.data, cached_credentials->server_alias, server->alias.len) == 0) {
-			                alias_found = 1;
-			            }
-					}
-					if (alias_found == 1) {
-						ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "User %s passed all checks, using cache to allow access", r->connection->addr_text.data, cached_credentials->username);
-						return NGX_OK;
-					} else {
-						ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0, "LDAP: User %s passed all checks, but cached data is from different LDAP server", r->connection->addr_text.data, cached_credentials->username);
-					}
-
-				} else {
-					// TODO: Really?
-					// TODO: Delete cache?
-					ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "User %s was found in ldap cache, but password does not match", uinfo->username.data);
-					cached_credentials->expires = ngx_time();
-					//return ngx_http_auth_ldap_set_realm(r, &conf->realm);
-				}
-			} else {
-				ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0, "LDAP: User %s was found in ldap cache, but IP does not match: %s != %s", uinfo->username.data, r->connection->addr_text.data, cached_credentials->client_ip);
-				cached_credentials->expires = ngx_time();
-				// TODO: Delete cache
-				// TODO: Really?
-				//return ngx_http_auth_ldap_set_realm(r, &conf->realm);
-			}
-		} else {
-			ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "LDAP: Possible hash collision: hash keys match, but usernames are not the same (%s != %s)!", uinfo->username.data, cached_credentials->username);
-			cached_credentials->expires = ngx_time();
-			// TODO: Delete cache
-		}
-	}
+    return NGX_CONF_OK;
+}
 
-	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Nothing found in cache, using LDAP auth");
+/**
+ * Create location conf
+ */
+static void *
+ngx_http_auth_basic_create_loc_conf(ngx_conf_t *cf) {
+    ngx_http_auth_ldap_loc_conf_t *conf;
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_ldap_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+    conf->servers = NGX_CONF_UNSET_PTR;
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->coalesce = NGX_CONF_UNSET;
+    conf->hedge = NGX_CONF_UNSET;
+    conf->hedge_delay = NGX_CONF_UNSET_MSEC;
 
+    return conf;
+}
 
-    /// Set LDAP version to 3 and set connection timeout.
-    ldap_set_option(NULL, LDAP_OPT_PROTOCOL_VERSION, &version);
-    ldap_set_option(NULL, LDAP_OPT_NETWORK_TIMEOUT, &timeOut);
+/**
+ * Resolve server aliases of location to ldap_server blocks, all of them are parsed by now
+ */
+static char *
+ngx_http_auth_ldap_resolve_servers(ngx_conf_t *cf, ngx_http_auth_ldap_loc_conf_t *conf)
+{
+    ngx_http_auth_ldap_conf_t *mconf;
+    ngx_ldap_server *servers, **server;
+    ngx_str_t *aliases;
+    ngx_uint_t i, k, n;
 
-    rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_REQUIRE_CERT, &reqcert);
-    if (rc != LDAP_OPT_SUCCESS) {
-        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "LDAP: unable to set require cert option: %s",
-            ldap_err2string(rc));
+    mconf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_ldap_module);
+
+    conf->ldap_servers = ngx_array_create(cf->pool, conf->servers->nelts, sizeof(ngx_ldap_server *));
+    if (conf->ldap_servers == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    // TODO: We might be using hash here, cause this loops is quite ugly, but it is simple and it works
-    int found;
-    for (k = 0; k < conf->servers->nelts; k++) {
-        alias = ((ngx_str_t*)conf->servers->elts + k);
-        found = 0;
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "CLIENT IP: %s", r->connection->addr_text.data);
-        for (i = 0; i < mconf->servers->nelts; i++) {
-            server = &servers[i];
-            if (server->alias.len == alias->len && ngx_strncmp(server->alias.data, alias->data, server->alias.len) == 0) {
-                found = 1;
-
-                pass = ngx_http_auth_ldap_authenticate_against_server(r, server, uinfo, conf);
-                if (pass == 1) {
-                    ngx_http_auth_ldap_cache_store(r, uinfo, server);
-                    return NGX_OK;
-                } else if (pass == NGX_HTTP_INTERNAL_SERVER_ERROR) {
-                   return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
+    aliases = conf->servers->elts;
+    servers = mconf->servers != NULL ? mconf->servers->elts : NULL;
+    n = mconf->servers != NULL ? mconf->servers->nelts : 0;
+
+    for (i = 0; i < conf->servers->nelts; i++) {
+        for (k = 0; k < n; k++) {
+            if (servers[k].alias.len == aliases[i].len
+                && ngx_strncmp(servers[k].alias.data, aliases[i].data, aliases[i].len) == 0)
+            {
+                break;
             }
         }
 
-        // If requested ldap server is not found, return 500 and write to log
-        if (found == 0) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "LDAP: Server \"%s\" is not defined!", alias->data);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        if (k == n) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "LDAP server \"%V\" is not defined", &aliases[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (servers[k].ludpp == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "LDAP server \"%V\" has no url", &aliases[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        server = ngx_array_push(conf->ldap_servers);
+        if (server == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *server = &servers[k];
+
+        // Result depends on the request itself, it can not be shared with other requests
+        if (ngx_http_auth_ldap_require_variables(servers[k].require_user)
+            || ngx_http_auth_ldap_require_variables(servers[k].require_group))
+        {
+            conf->variable_requires = 1;
         }
     }
 
-    return ngx_http_auth_ldap_set_realm(r, &conf->realm);
+    return NGX_CONF_OK;
 }
 
 /**
- * Actual authentication against LDAP server
+ * Check if any of require rules uses variables
  */
-static ngx_int_t ngx_http_auth_ldap_authenticate_against_server(ngx_http_request_t *r, ngx_ldap_server *server, ngx_ldap_userinfo *uinfo, ngx_http_auth_ldap_loc_conf_t *conf) {
-    LDAPURLDesc *ludpp = server->ludpp;
-    int rc;
-    LDAP *ld;
-    LDAPMessage *searchResult;
-    char *dn;
-    u_char *p, *filter;
-    ngx_ldap_require_t *value;
+static ngx_flag_t
+ngx_http_auth_ldap_require_variables(ngx_array_t *requires)
+{
+    ngx_ldap_require_t *rule;
+    ngx_uint_t i;
+
+    if (requires == NULL) {
+        return 0;
+    }
+
+    rule = requires->elts;
+    for (i = 0; i < requires->nelts; i++) {
+        if (rule[i].lengths != NULL) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Merge location conf
+ */
+static char *
+ngx_http_auth_ldap_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
+    ngx_http_auth_ldap_loc_conf_t *prev = parent;
+    ngx_http_auth_ldap_loc_conf_t *conf = child;
+
+    if (conf->realm.data == NULL) {
+        conf->realm = prev->realm;
+    }
+    ngx_conf_merge_ptr_value(conf->servers, prev->servers, NULL);
+
+    if (conf->servers == prev->servers && prev->ldap_servers != NULL) {
+        conf->ldap_servers = prev->ldap_servers;
+        conf->variable_requires = prev->variable_requires;
+    } else if (conf->servers != NULL && ngx_http_auth_ldap_resolve_servers(cf, conf) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NGX_CONF_UNSET_PTR);
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 1);
+    ngx_conf_merge_value(conf->hedge, prev->hedge, 0);
+    ngx_conf_merge_msec_value(conf->hedge_delay, prev->hedge_delay, 0);
+
+    // Default zone is resolved only where authentication is on, levels without realm
+    // keep the zone unset, so that locations enabling auth_ldap still get the default
+    if (conf->cache_zone == NGX_CONF_UNSET_PTR && conf->realm.len > 0) {
+        // fall back to default zone, it is created on first use unless it was declared explicitly
+        ngx_str_t name = ngx_string(NGX_HTTP_AUTH_LDAP_CACHE_NAME);
+        conf->cache_zone = ngx_http_auth_ldap_find_cache(cf, &name);
+        if (conf->cache_zone == NULL) {
+            conf->cache_zone = ngx_http_auth_ldap_add_cache(cf, &name, NGX_HTTP_AUTH_LDAP_CACHE_SIZE);
+            if (conf->cache_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Parse auth_ldap_hedge directive: off, parallel or delay before next server is queried
+ */
+static char *
+ngx_http_auth_ldap_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_auth_ldap_loc_conf_t *lcf = conf;
+    ngx_str_t *value;
+    ngx_msec_t delay;
+
+    if (lcf->hedge != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->hedge = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "parallel") == 0) {
+        lcf->hedge = 1;
+        lcf->hedge_delay = 0;
+        return NGX_CONF_OK;
+    }
+
+    delay = ngx_parse_time(&value[1], 0);
+    if (delay == (ngx_msec_t) NGX_ERROR || delay == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\" in \"%V\" directive", &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->hedge = 1;
+    lcf->hedge_delay = delay;
+    return NGX_CONF_OK;
+}
+
+/**
+ * Parse auth_ldap_thread_pool directive
+ */
+static char *
+ngx_http_auth_ldap_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_auth_ldap_conf_t *cnf = conf;
+    ngx_str_t *value;
+
+    if (cnf->thread_pool != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    cnf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (cnf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"auth_ldap_thread_pool\" requires nginx built with threads support");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * Parse auth_ldap_status directive, location shows statistics of all servers and cache zones
+ */
+static char *
+ngx_http_auth_ldap_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_auth_ldap_loc_conf_t *alcf = conf;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_str_t *value;
+
+    if (alcf->status_format) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    alcf->status_format = NGX_HTTP_AUTH_LDAP_STATUS_JSON;
+
+    if (cf->args->nelts > 1) {
+        if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+            alcf->status_format = NGX_HTTP_AUTH_LDAP_STATUS_PROMETHEUS;
+        } else if (ngx_strcmp(value[1].data, "json") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Incorrect value for auth_ldap_status: %V", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_auth_ldap_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Parse auth_ldap_cache_zone directive
+ */
+static char *
+ngx_http_auth_ldap_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t *value, name, s, *prefix;
+    ngx_uint_t i, k;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_int_t n;
+    ssize_t size;
+    time_t ttl;
+    u_char *p;
+
+    value = cf->args->elts;
+
+    name.len = 0;
+    size = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "keys_zone=", sizeof("keys_zone=") - 1) == 0) {
+            name.data = value[i].data + sizeof("keys_zone=") - 1;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" must have \"keys_zone\" parameter", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_http_auth_ldap_add_cache(cf, &name, size);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache = shm_zone->data;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "keys_zone=", sizeof("keys_zone=") - 1) == 0) {
+            continue;
+        }
+
+        // ttl and max_entries parameters of each kind of records
+        for (k = 0; k < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; k++) {
+            prefix = &ngx_http_auth_ldap_cache_kind_names[k];
+
+            if (ngx_strncmp(value[i].data, prefix->data, prefix->len) != 0) {
+                continue;
+            }
+
+            s.data = value[i].data + prefix->len;
+            s.len = value[i].len - prefix->len;
+
+            if (ngx_strncmp(s.data, "ttl=", sizeof("ttl=") - 1) == 0) {
+                s.data += sizeof("ttl=") - 1;
+                s.len -= sizeof("ttl=") - 1;
+
+                ttl = ngx_parse_time(&s, 1);
+                if (ttl == (time_t) NGX_ERROR) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ttl \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+                cache->ttl[k] = ttl;
+                break;
+            }
+
+            if (ngx_strncmp(s.data, "max_entries=", sizeof("max_entries=") - 1) == 0) {
+                n = ngx_atoi(s.data + sizeof("max_entries=") - 1, s.len - (sizeof("max_entries=") - 1));
+                if (n == NGX_ERROR || n == 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid max_entries \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+                cache->max_entries[k] = n;
+                break;
+            }
+        }
+
+        if (k < NGX_HTTP_AUTH_LDAP_CACHE_KINDS) {
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "stale_revalidate=", sizeof("stale_revalidate=") - 1) == 0) {
+            s.data = value[i].data + sizeof("stale_revalidate=") - 1;
+            s.len = value[i].len - (sizeof("stale_revalidate=") - 1);
+
+            ttl = ngx_parse_time(&s, 1);
+            if (ttl == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid stale_revalidate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            cache->stale_revalidate = ttl;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "stale_if_error=", sizeof("stale_if_error=") - 1) == 0) {
+            s.data = value[i].data + sizeof("stale_if_error=") - 1;
+            s.len = value[i].len - (sizeof("stale_if_error=") - 1);
+
+            ttl = ngx_parse_time(&s, 1);
+            if (ttl == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid stale_if_error \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            cache->stale_if_error = ttl;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "cleanup_batch=", sizeof("cleanup_batch=") - 1) == 0) {
+            n = ngx_atoi(value[i].data + sizeof("cleanup_batch=") - 1, value[i].len - (sizeof("cleanup_batch=") - 1));
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid cleanup_batch \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            cache->cleanup_batch = n;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "scope=addr") == 0) {
+            cache->scope_addr = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "scope=none") == 0) {
+            cache->scope_addr = 0;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Parse auth_ldap_cache directive
+ */
+static char *
+ngx_http_auth_ldap_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_auth_ldap_loc_conf_t *lcf = conf;
+    ngx_str_t *value;
+
+    if (lcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    // zone may be declared later in the config, its size is checked at init
+    lcf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_auth_ldap_module);
+    if (lcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Finds cache zone declared by auth_ldap_cache_zone
+ */
+static ngx_shm_zone_t *
+ngx_http_auth_ldap_find_cache(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_http_auth_ldap_conf_t *mconf;
+    ngx_shm_zone_t **zones;
+    ngx_uint_t i;
+
+    mconf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_ldap_module);
+
+    zones = mconf->caches->elts;
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        if (zones[i]->shm.name.len == name->len
+            && ngx_strncmp(zones[i]->shm.name.data, name->data, name->len) == 0)
+        {
+            return zones[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Registers new cache zone
+ */
+static ngx_shm_zone_t *
+ngx_http_auth_ldap_add_cache(ngx_conf_t *cf, ngx_str_t *name, size_t size)
+{
+    ngx_http_auth_ldap_conf_t *mconf;
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_shm_zone_t *shm_zone, **zones;
+
+    mconf = ngx_http_conf_get_module_main_conf(cf, ngx_http_auth_ldap_module);
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_auth_ldap_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_http_auth_ldap_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", name);
+        return NULL;
+    }
+
+    cache->shm_zone = shm_zone;
+    cache->data = mconf;
+    cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE] = NGX_HTTP_AUTH_LDAP_CACHE_EXPIRE;
+    cache->max_entries[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE] = NGX_HTTP_AUTH_LDAP_NEGATIVE_MAX_ENTRIES;
+    cache->max_entries[NGX_HTTP_AUTH_LDAP_CACHE_GROUP] = NGX_HTTP_AUTH_LDAP_GROUP_MAX_ENTRIES;
+    cache->max_entries[NGX_HTTP_AUTH_LDAP_CACHE_DN] = NGX_HTTP_AUTH_LDAP_DN_MAX_ENTRIES;
+    cache->cleanup_batch = NGX_HTTP_AUTH_LDAP_CLEANUP_BATCH_SIZE;
+    cache->scope_addr = 1;
+
+    shm_zone->init = ngx_http_auth_ldap_init_shm_zone;
+    shm_zone->data = cache;
+
+    zones = ngx_array_push(mconf->caches);
+    if (zones == NULL) {
+        return NULL;
+    }
+    *zones = shm_zone;
+
+    return shm_zone;
+}
+
+/**
+ * LDAP Authentication handler
+ */
+static ngx_int_t ngx_http_auth_ldap_handler(ngx_http_request_t *r) {
+    int rc;
+    ngx_http_auth_ldap_loc_conf_t *alcf;
+    ngx_http_auth_ldap_ctx_t *ctx;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_auth_ldap_module);
+
+    if (alcf->realm.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    // Handler is called again when async authentication makes progress
+    ctx = ngx_http_get_module_ctx(r, ngx_http_auth_ldap_module);
+    if (ctx != NULL) {
+        return ngx_http_auth_ldap_process_all(ctx);
+    }
+
+    ngx_http_auth_ldap_conf_t  *cnf;
+
+    cnf = ngx_http_get_module_main_conf(r, ngx_http_auth_ldap_module);
+
+    rc = ngx_http_auth_basic_user(r);
+
+    if (rc == NGX_DECLINED) {
+        return ngx_http_auth_ldap_set_realm(r, &alcf->realm);
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return ngx_http_auth_ldap_authenticate(r, alcf, cnf);
+}
+
+/**
+ * Get login and password from http request.
+ */
+static ngx_ldap_userinfo*
+ngx_http_auth_ldap_get_user_info(ngx_http_request_t *r) {
+    size_t len;
+    ngx_ldap_userinfo* uinfo;
+    u_char *uname_buf, *p;
+
+    uinfo = ngx_palloc(r->pool, sizeof(ngx_ldap_userinfo));
+
+    for (len = 0; len < r->headers_in.user.len; len++) {
+        if (r->headers_in.user.data[len] == ':') {
+            break;
+        }
+    }
+
+    uname_buf = ngx_palloc(r->pool, len + 1);
+    if (uname_buf == NULL) {
+        return NULL;
+    }
+    p = ngx_cpymem(uname_buf, r->headers_in.user.data, len);
+    *p = '\0';
+
+    uinfo->username.data = uname_buf;
+    uinfo->username.len = len;
+    uinfo->password.data = r->headers_in.passwd.data;
+    uinfo->password.len = r->headers_in.passwd.len;
+
+    return uinfo;
+}
+
+/**
+ * Read user credentials from request, set LDAP parameters and start authentication against required servers
+ */
+static ngx_int_t ngx_http_auth_ldap_authenticate(ngx_http_request_t *r, ngx_http_auth_ldap_loc_conf_t *conf,
+        ngx_http_auth_ldap_conf_t *mconf) {
+
+    int rc;
+
+    ngx_ldap_userinfo *uinfo;
+    ngx_http_auth_ldap_ctx_t *ctx;
+    ngx_pool_cleanup_t *cln;
+    ngx_uint_t stale;
+
+    uinfo = ngx_http_auth_ldap_get_user_info(r);
+
+    if (uinfo == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (uinfo->password.len == 0)
+    {
+        return ngx_http_auth_ldap_set_realm(r, &conf->realm);
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_auth_ldap_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    // Make sure LDAP connection is closed even if request is finalized while we are waiting for the server
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    cln->handler = ngx_http_auth_ldap_ctx_cleanup;
+    cln->data = ctx;
+
+    ctx->r = r;
+    ctx->pool = r->pool;
+    ctx->log = r->connection->log;
+    ctx->addr = r->connection->addr_text;
+    ctx->conf = conf;
+    ctx->mconf = mconf;
+    ctx->uinfo = uinfo;
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_CONNECT;
+    ctx->main = ctx;
+    ctx->next_server = 1;
+    ctx->started = ngx_current_msec;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_auth_ldap_module);
+
+    stale = 0;
+
+    // Request ctx is kept even if cache decides, it holds values of variables
+    if (conf->cache_zone != NULL) {
+        rc = ngx_http_auth_ldap_cache_lookup(r, conf->cache_zone->data, conf, mconf, uinfo, &stale,
+            &ctx->server_answered);
+        if (rc == NGX_OK) {
+            if ((stale & NGX_HTTP_AUTH_LDAP_STALE_REVALIDATE)
+                && ngx_http_auth_ldap_revalidate(r, conf, mconf, uinfo) != NGX_OK)
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "LDAP: unable to refresh cache of user %s",
+                    uinfo->username.data);
+            }
+            ctx->cache_status = (stale & NGX_HTTP_AUTH_LDAP_STALE_USED) ? NGX_HTTP_AUTH_LDAP_CACHE_STALE
+                                                                         : NGX_HTTP_AUTH_LDAP_CACHE_HIT;
+            ngx_http_auth_ldap_finish(ctx, NGX_OK);
+            return NGX_OK;
+        }
+        if (rc == NGX_HTTP_UNAUTHORIZED) {
+            ctx->cache_status = NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE_HIT;
+            ngx_http_auth_ldap_finish(ctx, NGX_HTTP_UNAUTHORIZED);
+            return ngx_http_auth_ldap_set_realm(r, &conf->realm);
+        }
+
+        ctx->cache_status = NGX_HTTP_AUTH_LDAP_CACHE_MISS;
+        ctx->stale = (stale & NGX_HTTP_AUTH_LDAP_STALE_IF_ERROR) ? 1 : 0;
+    }
+
+	ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Nothing found in cache, using LDAP auth");
+
+    // Synchronous authentication is over before any other request can come
+    if (conf->coalesce && mconf->nonblocking && !conf->variable_requires) {
+        if (ngx_http_auth_ldap_join_flight(ctx) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (ctx->phase == NGX_HTTP_AUTH_LDAP_PHASE_FOLLOW) {
+            return NGX_AGAIN;
+        }
+    }
+
+    // Hedging needs async or thread pool mode, synchronous attempt would block the others
+    if (conf->hedge && mconf->nonblocking && conf->ldap_servers->nelts > 1) {
+        if (conf->hedge_delay == 0) {
+            while (ctx->next_server < conf->ldap_servers->nelts) {
+                if (ngx_http_auth_ldap_add_attempt(ctx) == NULL) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+            }
+        } else {
+            ctx->hedge_timer.handler = ngx_http_auth_ldap_hedge_handler;
+            ctx->hedge_timer.data = ctx;
+            ctx->hedge_timer.log = r->connection->log;
+            ngx_add_timer(&ctx->hedge_timer, conf->hedge_delay);
+        }
+    }
+
+    return ngx_http_auth_ldap_process_all(ctx);
+}
+
+/**
+ * Refresh stale cache record in background: authentication runs in its own pool, detached from the request
+ */
+static ngx_int_t
+ngx_http_auth_ldap_revalidate(ngx_http_request_t *r, ngx_http_auth_ldap_loc_conf_t *conf,
+    ngx_http_auth_ldap_conf_t *mconf, ngx_ldap_userinfo *uinfo)
+{
+    ngx_pool_t *pool;
+    ngx_http_auth_ldap_ctx_t *ctx;
+    ngx_ldap_userinfo *binfo;
+    ngx_pool_cleanup_t *cln;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: refreshing cache of user %s in background",
+        uinfo->username.data);
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    binfo = ngx_pcalloc(pool, sizeof(ngx_ldap_userinfo));
+    ctx = ngx_pcalloc(pool, sizeof(ngx_http_auth_ldap_ctx_t));
+    if (binfo == NULL || ctx == NULL) {
+        goto failed;
+    }
+
+    // Client address is kept, cache records may be scoped to it
+    ctx->addr.len = r->connection->addr_text.len;
+    ctx->addr.data = ngx_pstrdup(pool, &r->connection->addr_text);
+
+    binfo->username.len = uinfo->username.len;
+    binfo->username.data = ngx_pnalloc(pool, uinfo->username.len + 1);
+    binfo->password.len = uinfo->password.len;
+    binfo->password.data = ngx_pnalloc(pool, uinfo->password.len + 1);
+    if (ctx->addr.data == NULL || binfo->username.data == NULL || binfo->password.data == NULL) {
+        goto failed;
+    }
+    *ngx_cpymem(binfo->username.data, uinfo->username.data, uinfo->username.len) = '\0';
+    *ngx_cpymem(binfo->password.data, uinfo->password.data, uinfo->password.len) = '\0';
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        goto failed;
+    }
+    cln->handler = ngx_http_auth_ldap_ctx_cleanup;
+    cln->data = ctx;
+
+    ctx->pool = pool;
+    ctx->log = ngx_cycle->log;
+    ctx->conf = conf;
+    ctx->mconf = mconf;
+    ctx->uinfo = binfo;
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_CONNECT;
+    ctx->main = ctx;
+    ctx->next_server = 1;
+    ctx->background = 1;
+
+    if (ngx_http_auth_ldap_process_all(ctx) != NGX_AGAIN) {
+        ngx_destroy_pool(pool);
+    }
+
+    return NGX_OK;
+
+failed:
+    ngx_destroy_pool(pool);
+    return NGX_ERROR;
+}
+
+/**
+ * Start authentication against next server of the location without waiting for the running attempts
+ */
+static ngx_http_auth_ldap_ctx_t *
+ngx_http_auth_ldap_add_attempt(ngx_http_auth_ldap_ctx_t *main)
+{
+    ngx_http_auth_ldap_ctx_t *ctx;
+    ngx_pool_cleanup_t *cln;
+
+    ctx = ngx_pcalloc(main->pool, sizeof(ngx_http_auth_ldap_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(main->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+    cln->handler = ngx_http_auth_ldap_ctx_cleanup;
+    cln->data = ctx;
+
+    ctx->r = main->r;
+    ctx->pool = main->pool;
+    ctx->log = main->log;
+    ctx->addr = main->addr;
+    ctx->conf = main->conf;
+    ctx->mconf = main->mconf;
+    ctx->uinfo = main->uinfo;
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_CONNECT;
+    ctx->main = main;
+    ctx->server_index = main->next_server++;
+
+    ctx->next = main->next;
+    main->next = ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, main->log, 0, "LDAP: hedged attempt against server %ui",
+        ctx->server_index);
+
+    return ctx;
+}
+
+/**
+ * Hedge delay has passed and no server answered yet, query the next one too
+ */
+static void
+ngx_http_auth_ldap_hedge_handler(ngx_event_t *ev)
+{
+    ngx_http_auth_ldap_ctx_t *main = ev->data;
+
+    if (main->next_server >= main->conf->ldap_servers->nelts) {
+        return;
+    }
+
+    if (ngx_http_auth_ldap_add_attempt(main) == NULL) {
+        return;
+    }
+
+    if (main->next_server < main->conf->ldap_servers->nelts) {
+        ngx_add_timer(&main->hedge_timer, main->conf->hedge_delay);
+    }
+
+    ngx_http_auth_ldap_resume(main);
+}
+
+/**
+ * Wait for identical authentication in progress in this worker, or lead the new one
+ */
+static ngx_int_t
+ngx_http_auth_ldap_join_flight(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_http_auth_ldap_ctx_t *leader;
+    ngx_queue_t *q;
+    u_char hash[SHA_DIGEST_LENGTH+1], *p;
+    ngx_str_t key;
+
+    if (ngx_http_auth_ldap_flights.next == NULL) {
+        ngx_queue_init(&ngx_http_auth_ldap_flights);
+    }
+
+    // Locations with the same servers share the list, so its address identifies the servers
+    ngx_http_auth_ldap_get_password_hash(&ctx->uinfo->username, &ctx->uinfo->password, hash);
+
+    key.len = sizeof(ngx_array_t *) + ctx->uinfo->username.len + 1 + SHA_DIGEST_LENGTH;
+    key.data = ngx_pnalloc(ctx->pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key.data, &ctx->conf->ldap_servers, sizeof(ngx_array_t *));
+    p = ngx_cpymem(p, ctx->uinfo->username.data, ctx->uinfo->username.len);
+    *p++ = '\0';
+    ngx_memcpy(p, hash, SHA_DIGEST_LENGTH);
+
+    for (q = ngx_queue_head(&ngx_http_auth_ldap_flights);
+         q != ngx_queue_sentinel(&ngx_http_auth_ldap_flights);
+         q = ngx_queue_next(q))
+    {
+        leader = ngx_queue_data(q, ngx_http_auth_ldap_ctx_t, flight);
+
+        if (leader->flight_key.len == key.len && ngx_memcmp(leader->flight_key.data, key.data, key.len) == 0) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                "LDAP: authentication of user %s is in progress, waiting for it", ctx->uinfo->username.data);
+
+            ctx->leader = leader;
+            ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_FOLLOW;
+            ngx_queue_insert_tail(&leader->followers, &ctx->flight);
+            return NGX_OK;
+        }
+    }
+
+    ctx->flight_key = key;
+    ngx_queue_init(&ctx->followers);
+    ngx_queue_insert_tail(&ngx_http_auth_ldap_flights, &ctx->flight);
+
+    return NGX_OK;
+}
+
+/**
+ * Pass result of leading request to its followers. Refusal and success are shared,
+ * on other results followers authenticate themselves.
+ */
+static void
+ngx_http_auth_ldap_land_flight(ngx_http_auth_ldap_ctx_t *leader, ngx_int_t status)
+{
+    ngx_http_auth_ldap_ctx_t *ctx;
+    ngx_queue_t *q;
+
+    if (leader->flight_key.len == 0) {
+        return;
+    }
+
+    ngx_queue_remove(&leader->flight);
+    ngx_str_null(&leader->flight_key);
+
+    while (!ngx_queue_empty(&leader->followers)) {
+        q = ngx_queue_head(&leader->followers);
+        ngx_queue_remove(q);
+
+        ctx = ngx_queue_data(q, ngx_http_auth_ldap_ctx_t, flight);
+        ctx->leader = NULL;
+
+        if (status == NGX_OK || status == NGX_HTTP_UNAUTHORIZED) {
+            ctx->status = status;
+            ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_DONE;
+            ctx->server_answered = leader->server_answered;
+        } else {
+            ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_CONNECT;
+        }
+
+        // Follower is resumed from event loop, not from inside of the leader's handler
+        ctx->wake_event.handler = ngx_http_auth_ldap_wake_handler;
+        ctx->wake_event.data = ctx;
+        ctx->wake_event.log = ctx->log;
+        ngx_post_event(&ctx->wake_event, &ngx_posted_events);
+    }
+}
+
+/**
+ * Resume follower request
+ */
+static void
+ngx_http_auth_ldap_wake_handler(ngx_event_t *ev)
+{
+    ngx_http_auth_ldap_ctx_t *ctx = ev->data;
+
+    ngx_http_auth_ldap_wake_request(ctx->r);
+}
+
+/**
+ * Run all attempts of the request, first one to accept the user wins.
+ * Credentials are refused only after all attempts have run out of servers.
+ */
+static ngx_int_t
+ngx_http_auth_ldap_process_all(ngx_http_auth_ldap_ctx_t *main)
+{
+    ngx_http_auth_ldap_ctx_t *ctx;
+    ngx_int_t rc, status;
+    ngx_flag_t pending;
+
+    status = NGX_HTTP_UNAUTHORIZED;
+    pending = 0;
+
+    for (ctx = main; ctx != NULL; ctx = ctx->next) {
+        rc = ngx_http_auth_ldap_process(ctx);
+
+        if (rc == NGX_AGAIN) {
+            pending = 1;
+            continue;
+        }
+
+        if (rc == NGX_OK) {
+            status = NGX_OK;
+            break;
+        }
+
+        if (rc != NGX_HTTP_UNAUTHORIZED) {
+            status = rc;
+        }
+    }
+
+    if (status != NGX_OK && pending) {
+        return NGX_AGAIN;
+    }
+
+    // Slower attempts are not needed anymore
+    if (main->hedge_timer.timer_set) {
+        ngx_del_timer(&main->hedge_timer);
+    }
+
+    for (ctx = main; ctx != NULL; ctx = ctx->next) {
+        if (ctx->phase != NGX_HTTP_AUTH_LDAP_PHASE_DONE) {
+            ngx_http_auth_ldap_finish(ctx, NGX_DECLINED);
+        }
+    }
+
+    // Servers have failed, but the user was verified recently
+    if (status != NGX_OK && main->stale && !main->answered) {
+        ngx_log_error(NGX_LOG_WARN, main->log, 0,
+            "LDAP: no server has answered, using stale cache to allow access of user %s", main->uinfo->username.data);
+        main->cache_status = NGX_HTTP_AUTH_LDAP_CACHE_STALE;
+        status = NGX_OK;
+    }
+
+    main->finished = ngx_current_msec;
+
+    ngx_http_auth_ldap_land_flight(main, status);
+
+    if (main->background) {
+        // Credentials are not valid anymore, stale record must not be served again
+        if (status == NGX_HTTP_UNAUTHORIZED && main->answered && main->conf->cache_zone != NULL) {
+            ngx_http_auth_ldap_cache_forget(main, main->conf->cache_zone->data, main->conf, main->uinfo);
+        }
+        return status;
+    }
+
+    if (status == NGX_HTTP_UNAUTHORIZED) {
+        return ngx_http_auth_ldap_set_realm(main->r, &main->conf->realm);
+    }
+
+    return status;
+}
+
+/**
+ * Run authentication state machine until it finishes or has to wait for LDAP server
+ */
+static ngx_int_t
+ngx_http_auth_ldap_process(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    for ( ;; ) {
+        if (ctx->waiting) {
+            return NGX_AGAIN;
+        }
+
+        if (ctx->op_timed) {
+            ngx_http_auth_ldap_op_stats(ctx);
+        }
+
+        switch (ctx->phase) {
+
+        case NGX_HTTP_AUTH_LDAP_PHASE_CONNECT:
+            ngx_http_auth_ldap_connect(ctx);
+            break;
+
+        case NGX_HTTP_AUTH_LDAP_PHASE_SERVICE_BIND:
+            ngx_http_auth_ldap_service_bind_done(ctx);
+            break;
+
+        case NGX_HTTP_AUTH_LDAP_PHASE_SEARCH:
+            ngx_http_auth_ldap_search_done(ctx);
+            break;
+
+        case NGX_HTTP_AUTH_LDAP_PHASE_COMPARE:
+            ngx_http_auth_ldap_compare_done(ctx);
+            break;
+
+        case NGX_HTTP_AUTH_LDAP_PHASE_USER_BIND:
+            ngx_http_auth_ldap_user_bind_done(ctx);
+            break;
+
+        case NGX_HTTP_AUTH_LDAP_PHASE_FOLLOW:
+            return NGX_AGAIN;
+
+        default: /* NGX_HTTP_AUTH_LDAP_PHASE_DONE */
+            return ctx->status;
+        }
+    }
+}
+
+/**
+ * Take connection to next server from the list (from keepalive pool or a new one)
+ */
+static void
+ngx_http_auth_ldap_connect(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_ldap_server *server;
+    ngx_http_auth_ldap_connection_t *lconn;
+    int rc;
+
+    if (ctx->server_index >= ctx->conf->ldap_servers->nelts) {
+        ngx_http_auth_ldap_finish(ctx, NGX_HTTP_UNAUTHORIZED);
+        return;
+    }
+
+    server = ((ngx_ldap_server **) ctx->conf->ldap_servers->elts)[ctx->server_index];
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "CLIENT IP: %V", &ctx->addr);
+
+    ctx->server = server;
+
+    if (!ngx_http_auth_ldap_server_available(ctx, server)) {
+        ngx_http_auth_ldap_next_server(ctx);
+        return;
+    }
+
+    ctx->pass = NGX_CONF_UNSET;
+    ctx->failed = 0;
+    ctx->dn = NULL;
+    ctx->dn_cached = 0;
+    ctx->group_index = 0;
+
+    // Cached DN is not used again when checking whether it is still right
+    if (ctx->dn_refused == NULL && ngx_http_auth_ldap_lookup_dn(ctx) != NGX_OK) {
+        ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    lconn = NULL;
+    if (!ctx->fresh_connection) {
+        lconn = ngx_http_auth_ldap_get_cached_connection(server, ctx->log);
+    }
+    ctx->fresh_connection = 0;
+
+    if (lconn != NULL) {
+        lconn->rctx = ctx;
+        ctx->lconn = lconn;
+
+        // Service bind sent when connection was released is still in flight
+        if (lconn->bind_pending) {
+            ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_SERVICE_BIND;
+            ngx_http_auth_ldap_wait_result(ctx, server->bind_timeout);
+            return;
+        }
+
+        ngx_http_auth_ldap_search_user(ctx);
+        return;
+    }
+
+    lconn = ngx_http_auth_ldap_open_connection(server, ctx->mconf, ctx->log);
+    if (lconn == NULL) {
+        ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    lconn->rctx = ctx;
+    ctx->lconn = lconn;
+
+    // User bind is the only operation needed with known DN and no user or group requirements
+    if (ctx->dn_cached && server->require_user == NULL && server->require_group == NULL) {
+        ngx_http_auth_ldap_check_requirements(ctx);
+        return;
+    }
+
+    /// Bind to the server
+    rc = ngx_http_auth_ldap_service_bind(lconn);
+    if (rc != LDAP_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "LDAP [%s]: ldap_sasl_bind error: %d, %s", server->url.data, rc,
+            ldap_err2string(rc));
+        // Do not throw 500 in case connection failure, multiple servers might be used for failover scenario
+        ngx_http_auth_ldap_next_server(ctx);
+        return;
+    }
+
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_SERVICE_BIND;
+    ngx_http_auth_ldap_wait_result(ctx, server->bind_timeout);
+}
+
+/**
+ * Create new LDAP session to the server, socket is connected with the first operation
+ */
+static ngx_http_auth_ldap_connection_t *
+ngx_http_auth_ldap_open_connection(ngx_ldap_server *server, ngx_http_auth_ldap_conf_t *mconf, ngx_log_t *log)
+{
+    ngx_http_auth_ldap_connection_t *lconn;
+    struct timeval timeOut;
+    int rc, version;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "LDAP: URL: %s", server->url.data);
+
+    lconn = ngx_calloc(sizeof(ngx_http_auth_ldap_connection_t), log);
+    if (lconn == NULL) {
+        return NULL;
+    }
+    lconn->server = server;
+    lconn->log = log;
+
+    rc = ldap_initialize(&lconn->ld, (const char*) server->url.data);
+    if (rc != LDAP_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "LDAP: Session initializing failed: %d, %s, (%s)", rc,
+            ldap_err2string(rc), (const char*) server->url.data);
+        ngx_free(lconn);
+        return NULL;
+    }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "LDAP: Session initialized", NULL);
+
+    /// Set LDAP version to 3 and connection timeout of the server
+    version = LDAP_VERSION3;
+    ldap_set_option(lconn->ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+    ngx_http_auth_ldap_msec_to_timeval(server->connect_timeout, &timeOut);
+    ldap_set_option(lconn->ld, LDAP_OPT_NETWORK_TIMEOUT, &timeOut);
+
+#ifdef LDAP_OPT_CONNECT_ASYNC
+    // Do not let libldap block in connect(), it is finished by nginx event loop or by thread pool task
+    if (mconf->nonblocking) {
+        ldap_set_option(lconn->ld, LDAP_OPT_CONNECT_ASYNC, LDAP_OPT_ON);
+    }
+#endif
+
+    return lconn;
+}
+
+/**
+ * Send bind with service credentials over the connection
+ */
+static int
+ngx_http_auth_ldap_service_bind(ngx_http_auth_ldap_connection_t *lconn)
+{
+    ngx_ldap_server *server = lconn->server;
+    struct berval cred;
+    int rc;
+
+    cred.bv_val = (char *) server->bind_dn_passwd.data;
+    cred.bv_len = server->bind_dn_passwd.len;
+    rc = ldap_sasl_bind(lconn->ld, (const char *) server->bind_dn.data, LDAP_SASL_SIMPLE, &cred, NULL, NULL,
+        &lconn->msgid);
+    if (rc != LDAP_SUCCESS) {
+        lconn->broken = 1;
+        return rc;
+    }
+
+    lconn->bind_pending = 1;
+    lconn->user_bound = 0;
+    return LDAP_SUCCESS;
+}
+
+/**
+ * Check service bind result and search the directory for the user
+ */
+static void
+ngx_http_auth_ldap_service_bind_done(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    int rc;
+
+    rc = ngx_http_auth_ldap_result_code(ctx);
+    if (ctx->result != NULL) {
+        ldap_msgfree(ctx->result);
+        ctx->result = NULL;
+    }
+    ctx->lconn->bind_pending = 0;
+
+    if (rc != LDAP_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "LDAP [%s]: service bind error: %d, %s", ctx->server->url.data, rc,
+            ldap_err2string(rc));
+        ctx->lconn->broken = 1;
+        // Do not throw 500 in case connection failure, multiple servers might be used for failover scenario
+        ngx_http_auth_ldap_next_server(ctx);
+        return;
+    }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: Bind successful", NULL);
+
+    ngx_http_auth_ldap_search_user(ctx);
+}
+
+/**
+ * Search the directory for the user over service-bound connection
+ */
+static void
+ngx_http_auth_ldap_search_user(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    LDAPURLDesc *ludpp = ctx->server->ludpp;
+    ngx_ldap_userinfo *uinfo = ctx->uinfo;
+    u_char *p, *filter;
+    int rc;
+
+    if (ctx->dn_cached) {
+        ngx_http_auth_ldap_check_requirements(ctx);
+        return;
+    }
+
+    /// Create filter for search users by uid
+    filter = ngx_pcalloc(
+        ctx->pool,
+        (ludpp->lud_filter != NULL ? ngx_strlen(ludpp->lud_filter) : ngx_strlen("(objectClass=*)")) + ngx_strlen("(&(=))")  + ngx_strlen(ludpp->lud_attrs[0])
+               + uinfo->username.len + 1);
+    if (filter == NULL) {
+        ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    p = ngx_sprintf(filter, "(&%s(%s=%s))", ludpp->lud_filter != NULL ? ludpp->lud_filter : "(objectClass=*)", ludpp->lud_attrs[0], uinfo->username.data);
+    *p = 0;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: filter %s", (const char*) filter);
+
+    /// Search the directory
+    rc = ngx_http_auth_ldap_search(ctx, filter);
+    if (rc != LDAP_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "LDAP: ldap_search_ext: %d, %s", rc, ldap_err2string(rc));
+        ctx->lconn->broken = 1;
+        // Connection taken from keepalive pool might have been closed by server in the meantime
+        if (ctx->lconn->reused) {
+            ngx_http_auth_ldap_next_server(ctx);
+            return;
+        }
+        ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_SEARCH;
+    ngx_http_auth_ldap_wait_result(ctx, ctx->server->search_timeout);
+}
+
+/**
+ * Send search request for the user entry
+ */
+static int
+ngx_http_auth_ldap_search(ngx_http_auth_ldap_ctx_t *ctx, u_char *filter)
+{
+    LDAPURLDesc *ludpp = ctx->server->ludpp;
+    struct timeval timeOut;
+    char *attrs[2];
+
+    ngx_http_auth_ldap_msec_to_timeval(ctx->server->search_timeout, &timeOut);
+
+    // Groups of the user come with its entry, so they do not have to be compared one by one later,
+    // otherwise only DN is needed and no attributes are returned
+    if (ctx->server->membership_attribute.len) {
+        attrs[0] = (char *) ctx->server->membership_attribute.data;
+    } else {
+        attrs[0] = LDAP_NO_ATTRS;
+    }
+    attrs[1] = NULL;
+
+    // Only the first entry is used, so the server does not have to send more
+    return ldap_search_ext(ctx->lconn->ld, ludpp->lud_dn, ludpp->lud_scope, (const char*) filter,
+        attrs, 0, NULL, NULL, &timeOut, 1, &ctx->lconn->msgid);
+}
+
+/**
+ * Check search result and "require user" rules, then continue with groups
+ */
+static void
+ngx_http_auth_ldap_search_done(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_ldap_server *server = ctx->server;
+    LDAP *ld = ctx->lconn->ld;
+    LDAPMessage *entry;
+    char *dn;
+    int rc;
+
+    rc = ngx_http_auth_ldap_result_code(ctx);
+
+    // More entries match the filter, the first one is used like before size limit was set
+    if (rc == LDAP_SIZELIMIT_EXCEEDED && ldap_count_entries(ld, ctx->result) > 0) {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "LDAP [%s]: more entries match user %s, using the first one",
+            server->url.data, ctx->uinfo->username.data);
+        rc = LDAP_SUCCESS;
+    }
+
+    if (rc != LDAP_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "LDAP: ldap_search_ext: %d, %s", rc, ldap_err2string(rc));
+        // Connection taken from keepalive pool might have been closed by server in the meantime
+        if (ctx->lconn->reused && ctx->lconn->broken) {
+            ngx_http_auth_ldap_next_server(ctx);
+            return;
+        }
+        ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    dn = NULL;
+    if (ldap_count_entries(ld, ctx->result) > 0) {
+        entry = ldap_first_entry(ld, ctx->result);
+        dn = ldap_get_dn(ld, entry);
+
+        if (dn != NULL && server->membership_attribute.len
+            && ngx_http_auth_ldap_get_memberships(ctx, entry) != NGX_OK)
+        {
+            ldap_memfree(dn);
+            ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    ldap_msgfree(ctx->result);
+    ctx->result = NULL;
+
+    if (dn == NULL) {
+        if (ctx->dn_refused != NULL) {
+            ctx->dn_refused = NULL;
+            ngx_http_auth_ldap_remove_dn(ctx);
+        }
+        ngx_http_auth_ldap_server_done(ctx);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: result DN %s", dn);
+
+    // User is where the cache said, so the password was wrong and binding again would only count one more failure
+    if (ctx->dn_refused != NULL) {
+        rc = ngx_strcmp(dn, ctx->dn_refused);
+        ctx->dn_refused = NULL;
+        if (rc == 0) {
+            ldap_memfree(dn);
+            ctx->pass = 0;
+            ngx_http_auth_ldap_server_done(ctx);
+            return;
+        }
+    }
+
+    ctx->dn = ngx_pnalloc(ctx->pool, ngx_strlen(dn) + 1);
+    if (ctx->dn == NULL) {
+        ldap_memfree(dn);
+        ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    ngx_memcpy(ctx->dn, dn, ngx_strlen(dn) + 1);
+    ldap_memfree(dn);
+
+    ngx_http_auth_ldap_store_dn(ctx);
+
+    ngx_http_auth_ldap_check_requirements(ctx);
+}
+
+/**
+ * Check require user rules against DN of the user and proceed to group checks
+ */
+static void
+ngx_http_auth_ldap_check_requirements(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_http_request_t *r = ctx->r;
+    ngx_ldap_server *server = ctx->server;
+    ngx_ldap_require_t *value;
+    ngx_uint_t i;
+
+    /// Check require user
+    if (server->require_user != NULL) {
+        value = server->require_user->elts;
+        for (i = 0; i < server->require_user->nelts; i++) {
+            ngx_str_t val;
+            if (value[i].lengths == NULL) {
+                val = value[i].value;
+            } else {
+                if (ngx_http_script_run(r, &val, value[i].lengths->elts, 0,
+                    value[i].values->elts) == NULL)
+                {
+                    ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+                val.data[val.len] = '\0';
+            }
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: compare with: %s", val.data);
+            if (ngx_strncmp(val.data, ctx->dn, val.len) == 0) {
+                ctx->pass = 1;
+                if (server->satisfy_all == 0) {
+                    break;
+                }
+            } else {
+                if (server->satisfy_all == 1) {
+                    ctx->pass = 0;
+                    ngx_http_auth_ldap_server_done(ctx);
+                    return;
+                }
+            }
+        }
+    }
+
+    /// Check require group
+    if (server->require_group != NULL) {
+        if (server->group_attribute_dn == 1) {
+            ctx->group_value.bv_val = ctx->dn;
+            ctx->group_value.bv_len = ngx_strlen(ctx->dn);
+        } else {
+            ctx->group_value.bv_val = (char*) ctx->uinfo->username.data;
+            ctx->group_value.bv_len = ctx->uinfo->username.len;
+        }
+    }
+
+    ngx_http_auth_ldap_check_group(ctx);
+}
+
+/**
+ * Copy group DNs listed in membership_attribute of the user entry to request pool
+ */
+static ngx_int_t
+ngx_http_auth_ldap_get_memberships(ngx_http_auth_ldap_ctx_t *ctx, LDAPMessage *entry)
+{
+    struct berval **vals;
+    ngx_str_t *group;
+    int i, n;
+
+    vals = ldap_get_values_len(ctx->lconn->ld, entry, (const char *) ctx->server->membership_attribute.data);
+    n = vals != NULL ? ldap_count_values_len(vals) : 0;
+
+    ctx->memberships = ngx_array_create(ctx->pool, n ? n : 1, sizeof(ngx_str_t));
+    if (ctx->memberships == NULL) {
+        goto failed;
+    }
+
+    for (i = 0; i < n; i++) {
+        group = ngx_array_push(ctx->memberships);
+        if (group == NULL) {
+            goto failed;
+        }
+
+        group->len = vals[i]->bv_len;
+        group->data = ngx_pnalloc(ctx->pool, group->len);
+        if (group->data == NULL) {
+            goto failed;
+        }
+        ngx_memcpy(group->data, vals[i]->bv_val, group->len);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: user is member of %d groups by %s",
+        n, ctx->server->membership_attribute.data);
+
+    if (vals != NULL) {
+        ldap_value_free_len(vals);
+    }
+    return NGX_OK;
+
+failed:
+    if (vals != NULL) {
+        ldap_value_free_len(vals);
+    }
+    return NGX_ERROR;
+}
+
+/**
+ * Send compare request for the next group, or proceed to user bind if all groups were checked
+ */
+static void
+ngx_http_auth_ldap_check_group(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_http_request_t *r = ctx->r;
+    ngx_ldap_server *server = ctx->server;
+    ngx_ldap_require_t *value;
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_http_auth_ldap_node_t *node;
+    ngx_str_t val, parts[3], *groups;
+    ngx_uint_t i;
+    int rc;
+
+    if (server->require_group == NULL || ctx->group_index >= server->require_group->nelts) {
+        ngx_http_auth_ldap_check_user_bind(ctx);
+        return;
+    }
+
+    value = (ngx_ldap_require_t *) server->require_group->elts + ctx->group_index;
+
+    if (value->lengths == NULL) {
+        val = value->value;
+    } else {
+        if (ngx_http_script_run(r, &val, value->lengths->elts, 0,
+            value->values->elts) == NULL)
+        {
+            ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+        val.data[val.len] = '\0';
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: group compare with: %s", val.data);
+
+    ctx->group_cached = 0;
+    ngx_str_null(&ctx->group_key);
+
+    if (server->membership_attribute.len) {
+        // Group DNs of the user were fetched by the search, so the group is matched locally
+        ctx->error = LDAP_COMPARE_FALSE;
+        groups = ctx->memberships->elts;
+        for (i = 0; i < ctx->memberships->nelts; i++) {
+            if (groups[i].len == val.len && ngx_strncasecmp(groups[i].data, val.data, val.len) == 0) {
+                ctx->error = LDAP_COMPARE_TRUE;
+                break;
+            }
+        }
+
+        ctx->result = NULL;
+        ctx->group_cached = 1;
+        ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_COMPARE;
+        return;
+    }
+
+    if (ctx->conf->cache_zone != NULL) {
+        cache = ctx->conf->cache_zone->data;
+
+        if (cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_GROUP]) {
+            parts[0].data = (u_char *) ctx->group_value.bv_val;
+            parts[0].len = ctx->group_value.bv_len;
+            parts[1] = val;
+            parts[2] = server->group_attribute;
+
+            rc = ngx_http_auth_ldap_cache_key(ctx->pool, cache, server, parts, 3, &ctx->group_key);
+            if (rc == NGX_ERROR) {
+                ngx_http_auth_ldap_finish(ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            if (rc == NGX_OK) {
+                ngx_shmtx_lock(&cache->shpool->mutex);
+                node = ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &ctx->group_key);
+                if (node != NULL) {
+                    ctx->error = node->data[node->key_len] ? LDAP_COMPARE_TRUE : LDAP_COMPARE_FALSE;
+                }
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+
+                if (node != NULL) {
+                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: group compare result found in cache: %d",
+                        ctx->error);
+                    ctx->result = NULL;
+                    ctx->group_cached = 1;
+                    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_COMPARE;
+                    return;
+                }
+            } else {
+                ngx_str_null(&ctx->group_key);
+            }
+        }
+    }
+
+    rc = ldap_compare_ext(ctx->lconn->ld, (const char*) val.data, (const char*) server->group_attribute.data,
+        &ctx->group_value, NULL, NULL, &ctx->lconn->msgid);
+
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_COMPARE;
+
+    if (rc != LDAP_SUCCESS) {
+        // Failed compare is handled as "not a member" right away
+        ctx->error = rc;
+        ctx->lconn->broken = 1;
+        return;
+    }
+
+    ngx_http_auth_ldap_wait_result(ctx, server->compare_timeout);
+}
+
+/**
+ * Check compare result for current group
+ */
+static void
+ngx_http_auth_ldap_compare_done(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_str_t value;
+    u_char member;
+    int rc;
+
+    rc = ngx_http_auth_ldap_result_code(ctx);
+    if (ctx->result != NULL) {
+        ldap_msgfree(ctx->result);
+        ctx->result = NULL;
+    }
+
+    // Only definite answers of the server are cached, errors are retried next time
+    if (!ctx->group_cached && ctx->group_key.len && (rc == LDAP_COMPARE_TRUE || rc == LDAP_COMPARE_FALSE)) {
+        member = (rc == LDAP_COMPARE_TRUE);
+        value.data = &member;
+        value.len = 1;
+        ngx_http_auth_ldap_cache_put(ctx->conf->cache_zone->data, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &ctx->group_key,
+            &value, ctx->log);
+    }
+
+    ctx->group_index++;
+
+    if (rc != LDAP_COMPARE_TRUE && rc != LDAP_COMPARE_FALSE) {
+        ctx->failed = 1;
+    }
+
+    if (rc == LDAP_COMPARE_TRUE) {
+        ctx->pass = 1;
+        if (ctx->server->satisfy_all == 0) {
+            ngx_http_auth_ldap_check_user_bind(ctx);
+            return;
+        }
+    } else {
+        if (ctx->server->satisfy_all == 1) {
+            ctx->pass = 0;
+            ngx_http_auth_ldap_check_user_bind(ctx);
+            return;
+        }
+    }
+
+    ngx_http_auth_ldap_check_group(ctx);
+}
+
+/**
+ * Bind as the user if requirements allow it
+ */
+static void
+ngx_http_auth_ldap_check_user_bind(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_ldap_server *server = ctx->server;
+    struct berval cred;
+    int rc;
+
+    /// Check valid user
+    if (ctx->pass != 0 || (server->require_valid_user == 1 && server->satisfy_all == 0 && ctx->pass == 0)) {
+        /// Bind user to the server
+        cred.bv_val = (char *) ctx->uinfo->password.data;
+        cred.bv_len = ctx->uinfo->password.len;
+        rc = ldap_sasl_bind(ctx->lconn->ld, ctx->dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &ctx->lconn->msgid);
+
+        ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_USER_BIND;
+        ctx->lconn->user_bound = 1;
+
+        if (rc != LDAP_SUCCESS) {
+            ctx->error = rc;
+            ctx->lconn->broken = 1;
+            return;
+        }
+
+        ngx_http_auth_ldap_wait_result(ctx, server->bind_timeout);
+        return;
+    }
+
+    ngx_http_auth_ldap_server_done(ctx);
+}
+
+/**
+ * Check user bind result
+ */
+static void
+ngx_http_auth_ldap_user_bind_done(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    int rc;
+
+    rc = ngx_http_auth_ldap_result_code(ctx);
+    if (ctx->result != NULL) {
+        ldap_msgfree(ctx->result);
+        ctx->result = NULL;
+    }
+
+    // User might have been moved or renamed, search for the DN on the same server, user is bound
+    // again only if the DN has changed. Errors of the server itself (timeout, down, busy) are not retried.
+    if (ctx->dn_cached
+        && (rc == LDAP_INVALID_CREDENTIALS || rc == LDAP_NO_SUCH_OBJECT || rc == LDAP_INVALID_DN_SYNTAX))
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: user bind with cached DN failed: %d, %s", rc,
+            ldap_err2string(rc));
+        ctx->dn_refused = ctx->dn;
+        ngx_http_auth_ldap_release_connection(ctx, 1);
+        ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_CONNECT;
+        return;
+    }
+
+    if (rc != LDAP_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0, "LDAP: user bind error: %d, %s", rc,
+            ldap_err2string(rc));
+        ctx->pass = 0;
+        if (rc != LDAP_INVALID_CREDENTIALS) {
+            ctx->failed = 1;
+        }
+    } else {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: User bind successful", NULL);
+        if (ctx->server->require_valid_user == 1) ctx->pass = 1;
+    }
+
+    ngx_http_auth_ldap_server_done(ctx);
+}
+
+/**
+ * Authentication against current server is over: allow access or try next server
+ */
+static void
+ngx_http_auth_ldap_server_done(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+
+    // Server has answered all the operations
+    if (!ctx->lconn->broken) {
+        ngx_http_auth_ldap_server_health(ctx, ctx->server, 0, LDAP_SUCCESS);
+    }
+
+    if (ctx->pass == 1) {
+        ctx->main->server_answered = ctx->server;
+        ngx_http_auth_ldap_release_connection(ctx, 1);
+        if (ctx->conf->cache_zone != NULL) {
+            ngx_http_auth_ldap_cache_store(ctx, ctx->conf->cache_zone->data, ctx->uinfo, ctx->server, 0);
+        }
+        ngx_http_auth_ldap_finish(ctx, NGX_OK);
+        return;
+    }
+
+    if (!ctx->failed && !ctx->lconn->broken) {
+        ctx->main->answered = 1;
+        ctx->main->server_answered = ctx->server;
+    }
+
+    // Server has refused the credentials without any error, remember it for a while
+    if (ctx->conf->cache_zone != NULL && !ctx->failed && !ctx->lconn->broken) {
+        cache = ctx->conf->cache_zone->data;
+        if (cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE]) {
+            ngx_http_auth_ldap_cache_store(ctx, cache, ctx->uinfo, ctx->server, 1);
+        }
+    }
+
+    ngx_http_auth_ldap_next_server(ctx);
+}
+
+/**
+ * Release current connection and move on to the next server from the list
+ */
+static void
+ngx_http_auth_ldap_next_server(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_http_auth_ldap_connection_t *lconn = ctx->lconn;
+
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_CONNECT;
+
+    // Kept alive connection went stale, try the same server once more over a new one
+    if (lconn != NULL && lconn->reused && lconn->broken) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP [%s]: cached connection is broken, reconnecting",
+            ctx->server->url.data);
+        ngx_http_auth_ldap_release_connection(ctx, 0);
+        ctx->fresh_connection = 1;
+        return;
+    }
+
+    ngx_http_auth_ldap_release_connection(ctx, 1);
+
+    // Servers are taken in order of the location, hedged attempts share the sequence
+    ctx->server_index = ctx->main->next_server++;
+    ctx->dn_refused = NULL;
+}
+
+/**
+ * Stop authentication with given status which is returned from access phase handler
+ */
+static void
+ngx_http_auth_ldap_finish(ngx_http_auth_ldap_ctx_t *ctx, ngx_int_t status)
+{
+    ngx_http_auth_ldap_release_connection(ctx, 0);
+    ctx->status = status;
+    ctx->phase = NGX_HTTP_AUTH_LDAP_PHASE_DONE;
+    ctx->finished = ngx_current_msec;
+}
+
+/**
+ * Returns LDAP result code of the last operation
+ */
+static int
+ngx_http_auth_ldap_result_code(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    int rc, err;
+
+    if (ctx->result == NULL) {
+        return ctx->error;
+    }
+
+    rc = ldap_parse_result(ctx->lconn->ld, ctx->result, &err, NULL, NULL, NULL, NULL, 0);
+    if (rc != LDAP_SUCCESS) {
+        return rc;
+    }
+
+    return err;
+}
+
+/**
+ * Wait for the result of operation sent over current connection.
+ * In async mode request is suspended until connection read handler gets the result,
+ * with thread pool until a task gets it, otherwise we block on the socket just like
+ * synchronous libldap calls do.
+ */
+static void
+ngx_http_auth_ldap_wait_result(ngx_http_auth_ldap_ctx_t *ctx, ngx_msec_t timeout)
+{
+    ngx_http_auth_ldap_connection_t *lconn = ctx->lconn;
+    struct timeval timeOut;
+    LDAPMessage *result;
+    int rc;
+
+    ctx->result = NULL;
+    ctx->error = LDAP_SUCCESS;
+    ctx->op_start = ngx_current_msec;
+    ctx->op_timed = 1;
+    ctx->main->ops++;
+
+    if (ctx->mconf->async) {
+        // Socket of new connection exists only once the first operation is sent, it is still connecting
+        if (lconn->conn == NULL) {
+            if (ngx_http_auth_ldap_add_connection(lconn) != NGX_OK) {
+                ctx->error = LDAP_LOCAL_ERROR;
+                lconn->broken = 1;
+                return;
+            }
+            timeout += lconn->server->connect_timeout;
+        }
+
+        ctx->waiting = 1;
+        ngx_add_timer(lconn->conn->read, timeout);
+        return;
+    }
+
+#if (NGX_THREADS)
+    if (ctx->mconf->thread_pool != NULL) {
+        if (ngx_http_auth_ldap_post_task(ctx, timeout) != NGX_OK) {
+            ctx->error = LDAP_LOCAL_ERROR;
+            lconn->broken = 1;
+            return;
+        }
+
+        ctx->waiting = 1;
+        return;
+    }
+#endif
+
+    ngx_http_auth_ldap_msec_to_timeval(timeout, &timeOut);
+
+    rc = ldap_result(lconn->ld, lconn->msgid, LDAP_MSG_ALL, &timeOut, &result);
+
+    // Worker was blocked, its clock is behind
+    ngx_time_update();
+
+    ngx_http_auth_ldap_result_done(ctx, rc, result);
+}
+
+/**
+ * Store outcome of blocking ldap_result() call to request state
+ */
+static void
+ngx_http_auth_ldap_result_done(ngx_http_auth_ldap_ctx_t *ctx, int rc, LDAPMessage *result)
+{
+    ngx_http_auth_ldap_connection_t *lconn = ctx->lconn;
+
+    if (rc == 0) {
+        ldap_abandon_ext(lconn->ld, lconn->msgid, NULL, NULL);
+        ctx->error = LDAP_TIMEOUT;
+        lconn->broken = 1;
+    } else if (rc == -1) {
+        ldap_get_option(lconn->ld, LDAP_OPT_RESULT_CODE, &ctx->error);
+        lconn->broken = 1;
+    } else {
+        ctx->result = result;
+    }
+}
+
+#if (NGX_THREADS)
+
+/**
+ * Wait for the result in thread pool, so the worker is not blocked
+ */
+static ngx_int_t
+ngx_http_auth_ldap_post_task(ngx_http_auth_ldap_ctx_t *ctx, ngx_msec_t timeout)
+{
+    ngx_http_auth_ldap_connection_t *lconn = ctx->lconn;
+    ngx_http_auth_ldap_task_ctx_t *tctx;
+    ngx_thread_task_t *task;
+
+    task = lconn->task;
+
+    // Like in async mode, the first operation of new connection waits for connect too
+    if (task == NULL) {
+        task = ngx_calloc(sizeof(ngx_thread_task_t) + sizeof(ngx_http_auth_ldap_task_ctx_t), lconn->log);
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->ctx = task + 1;
+        task->handler = ngx_http_auth_ldap_task_handler;
+        task->event.handler = ngx_http_auth_ldap_task_done;
+        task->event.data = lconn;
+        lconn->task = task;
+
+        timeout += lconn->server->connect_timeout;
+    }
+
+    tctx = task->ctx;
+    tctx->ld = lconn->ld;
+    tctx->msgid = lconn->msgid;
+    tctx->result = NULL;
+    ngx_http_auth_ldap_msec_to_timeval(timeout, &tctx->timeout);
+    task->event.log = lconn->log;
+
+    if (ngx_thread_task_post(ctx->mconf->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    lconn->task_busy = 1;
+    return NGX_OK;
+}
+
+/**
+ * Thread pool task: block on the socket until the result comes
+ */
+static void
+ngx_http_auth_ldap_task_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_auth_ldap_task_ctx_t *tctx = data;
+
+    tctx->rc = ldap_result(tctx->ld, tctx->msgid, LDAP_MSG_ALL, &tctx->timeout, &tctx->result);
+}
+
+/**
+ * Task is over, resume the request in worker's event loop
+ */
+static void
+ngx_http_auth_ldap_task_done(ngx_event_t *ev)
+{
+    ngx_http_auth_ldap_connection_t *lconn = ev->data;
+    ngx_http_auth_ldap_task_ctx_t *tctx = lconn->task->ctx;
+    ngx_http_auth_ldap_ctx_t *ctx = lconn->rctx;
+
+    lconn->task_busy = 0;
+
+    // Request was finalized while the task was running, its connection waits to be closed
+    if (ctx == NULL) {
+        if (tctx->result != NULL) {
+            ldap_msgfree(tctx->result);
+        }
+        ngx_http_auth_ldap_close_connection(lconn);
+        return;
+    }
+
+    ngx_http_auth_ldap_result_done(ctx, tctx->rc, tctx->result);
+
+    ctx->waiting = 0;
+    ngx_http_auth_ldap_resume(ctx);
+}
+
+#endif
+
+/**
+ * Count operation which has just finished in statistics of the server
+ */
+static void
+ngx_http_auth_ldap_op_stats(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_http_auth_ldap_server_stats_t *stats;
+    ngx_uint_t i, op;
+    ngx_msec_t ms;
+
+    ctx->op_timed = 0;
+
+    if (ctx->server->health == NULL) {
+        return;
+    }
+
+    switch (ctx->phase) {
+    case NGX_HTTP_AUTH_LDAP_PHASE_SERVICE_BIND:
+    case NGX_HTTP_AUTH_LDAP_PHASE_USER_BIND:
+        op = NGX_HTTP_AUTH_LDAP_OP_BIND;
+        break;
+    case NGX_HTTP_AUTH_LDAP_PHASE_SEARCH:
+        op = NGX_HTTP_AUTH_LDAP_OP_SEARCH;
+        break;
+    case NGX_HTTP_AUTH_LDAP_PHASE_COMPARE:
+        op = NGX_HTTP_AUTH_LDAP_OP_COMPARE;
+        break;
+    default:
+        return;
+    }
+
+    stats = &ctx->server->health->stats;
+    ms = ngx_current_msec - ctx->op_start;
+
+    ngx_atomic_fetch_add(&stats->ops[op], 1);
+
+    if (ctx->result == NULL) {
+        ngx_atomic_fetch_add(&stats->errors, 1);
+        if (ctx->error == LDAP_TIMEOUT) {
+            ngx_atomic_fetch_add(&stats->timeouts, 1);
+        }
+    }
+
+    for (i = 0; i < NGX_HTTP_AUTH_LDAP_LATENCY_BUCKETS - 1; i++) {
+        if (ms <= ngx_http_auth_ldap_latency_buckets[i]) {
+            break;
+        }
+    }
+
+    ngx_atomic_fetch_add(&stats->latency[i], 1);
+    ngx_atomic_fetch_add(&stats->latency_sum, ms);
+}
+
+/**
+ * Convert timeout in milliseconds for libldap
+ */
+static void
+ngx_http_auth_ldap_msec_to_timeval(ngx_msec_t ms, struct timeval *tv)
+{
+    tv->tv_sec = ms / 1000;
+    tv->tv_usec = (ms % 1000) * 1000;
+}
+
+/**
+ * Register LDAP socket in nginx event loop
+ */
+static ngx_int_t
+ngx_http_auth_ldap_add_connection(ngx_http_auth_ldap_connection_t *lconn)
+{
+    ngx_connection_t *c;
+    int fd;
+
+    if (ldap_get_option(lconn->ld, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS || fd < 0) {
+        ngx_log_error(NGX_LOG_ERR, lconn->log, 0, "LDAP: unable to get connection descriptor");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection((ngx_socket_t) fd, lconn->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->data = lconn;
+    c->log = lconn->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+    c->read->handler = ngx_http_auth_ldap_read_handler;
+    c->write->handler = ngx_http_auth_ldap_write_handler;
+    lconn->conn = c;
+
+    if (ngx_add_conn) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        return NGX_OK;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    // Socket might be still connecting, libldap will send the request once it becomes writable
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Connection became writable: let libldap finish connect and flush pending request
+ */
+static void
+ngx_http_auth_ldap_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t *c = wev->data;
+
+    if (!(ngx_event_flags & NGX_USE_CLEAR_EVENT) && wev->active) {
+        // Level-triggered write events would fire all the time while socket is idle
+        ngx_del_event(wev, NGX_WRITE_EVENT, 0);
+    }
+
+    ngx_http_auth_ldap_read_handler(c->read);
+}
+
+/**
+ * Read result of pending operation from LDAP socket and resume the request
+ */
+static void
+ngx_http_auth_ldap_read_handler(ngx_event_t *rev)
+{
+    ngx_connection_t *c = rev->data;
+    ngx_http_auth_ldap_connection_t *lconn = c->data;
+    ngx_http_auth_ldap_ctx_t *ctx = lconn->rctx;
+    struct timeval timeOut = { 0, 0 };
+    LDAPMessage *result;
+    int rc;
+
+    if (ctx == NULL) {
+        ngx_http_auth_ldap_idle_handler(lconn);
+        return;
+    }
+
+    if (!ctx->waiting) {
+        return;
+    }
+
+    if (rev->timedout) {
+        rev->timedout = 0;
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "LDAP [%s]: operation timed out", lconn->server->url.data);
+        ldap_abandon_ext(lconn->ld, lconn->msgid, NULL, NULL);
+        ctx->error = LDAP_TIMEOUT;
+        lconn->broken = 1;
+
+    } else {
+        rc = ldap_result(lconn->ld, lconn->msgid, LDAP_MSG_ALL, &timeOut, &result);
+        if (rc == 0) {
+            // Result is not complete yet
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ctx->error = LDAP_LOCAL_ERROR;
+                lconn->broken = 1;
+            } else {
+                return;
+            }
+
+        } else if (rc == -1) {
+            ldap_get_option(lconn->ld, LDAP_OPT_RESULT_CODE, &ctx->error);
+            lconn->broken = 1;
+
+        } else {
+            ctx->result = result;
+        }
+
+        if (rev->timer_set) {
+            ngx_del_timer(rev);
+        }
+    }
+
+    ctx->waiting = 0;
+    ngx_http_auth_ldap_resume(ctx);
+}
+
+/**
+ * Handle events on connection sitting in keepalive pool
+ */
+static void
+ngx_http_auth_ldap_idle_handler(ngx_http_auth_ldap_connection_t *lconn)
+{
+    ngx_connection_t *c = lconn->conn;
+    struct timeval timeOut = { 0, 0 };
+    LDAPMessage *result;
+    int rc, err;
+
+    // Connections kept warm are checked by a search instead of being closed
+    if (!c->close && c->read->timedout && ngx_http_auth_ldap_keep_warm(lconn) == NGX_OK) {
+        c->read->timedout = 0;
+        return;
+    }
+
+    if (c->close || c->read->timedout) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "LDAP [%s]: closing idle connection", lconn->server->url.data);
+        ngx_queue_remove(&lconn->queue);
+        ngx_http_auth_ldap_close_connection(lconn);
+        return;
+    }
+
+    for ( ;; ) {
+        rc = ldap_result(lconn->ld, LDAP_RES_ANY, LDAP_MSG_ALL, &timeOut, &result);
+        if (rc == 0) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                break;
+            }
+            return;
+        }
+
+        if (rc == -1) {
+            break;
+        }
+
+        // Result of service bind sent when connection was returned to the pool (or of keepalive search)
+        if (lconn->bind_pending && ldap_msgid(result) == lconn->msgid) {
+            rc = ldap_parse_result(lconn->ld, result, &err, NULL, NULL, NULL, NULL, 1);
+            lconn->bind_pending = 0;
+            if (rc != LDAP_SUCCESS || err != LDAP_SUCCESS) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0, "LDAP [%s]: idle connection check error: %d, %s",
+                    lconn->server->url.data, err, ldap_err2string(err));
+                break;
+            }
+            lconn->idle_since = ngx_current_msec;
+            continue;
+        }
+
+        // Anything else (e.g. notice of disconnection) means connection is not usable anymore
+        ldap_msgfree(result);
+        break;
+    }
+
+    ngx_queue_remove(&lconn->queue);
+    ngx_http_auth_ldap_close_connection(lconn);
+}
+
+/**
+ * Keep idle connection open if the server needs it prewarmed: send no-op search to check it
+ * and to prevent the server from dropping it
+ */
+static ngx_int_t
+ngx_http_auth_ldap_keep_warm(ngx_http_auth_ldap_connection_t *lconn)
+{
+    ngx_ldap_server *server = lconn->server;
+    char *attrs[] = { LDAP_NO_ATTRS, NULL };
+    int rc;
+
+    // Connection which did not answer the previous check is dead
+    if (lconn->bind_pending || ngx_http_auth_ldap_free_connections(server) > server->prewarm) {
+        return NGX_DECLINED;
+    }
+
+    rc = ldap_search_ext(lconn->ld, "", LDAP_SCOPE_BASE, "(objectClass=*)", attrs, 0, NULL, NULL, NULL, 0,
+        &lconn->msgid);
+    if (rc != LDAP_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, lconn->log, 0, "LDAP [%s]: keepalive search error: %d, %s", server->url.data, rc,
+            ldap_err2string(rc));
+        return NGX_ERROR;
+    }
+
+    lconn->bind_pending = 1;
+    ngx_add_timer(lconn->conn->read, server->keepalive_timeout);
+    return NGX_OK;
+}
+
+/**
+ * Open one missing prewarmed connection to the server, then come again for the next one
+ */
+static void
+ngx_http_auth_ldap_prewarm_handler(ngx_event_t *ev)
+{
+    ngx_ldap_server *server = ev->data;
+    ngx_http_auth_ldap_conf_t *mconf;
+    ngx_http_auth_ldap_connection_t *lconn;
+    ngx_uint_t n;
+    ngx_msec_t delay;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    mconf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_auth_ldap_module);
+
+    // Pool is checked again later, connections closed in the meantime are replaced
+    delay = server->keepalive_timeout;
+
+    n = ngx_http_auth_ldap_free_connections(server);
+    if (n < server->prewarm) {
+        lconn = ngx_http_auth_ldap_open_connection(server, mconf, ngx_cycle->log);
+
+        if (lconn != NULL && ngx_http_auth_ldap_service_bind(lconn) != LDAP_SUCCESS) {
+            ngx_log_error(NGX_LOG_ERR, ev->log, 0, "LDAP [%s]: prewarm connection failed", server->url.data);
+            ngx_http_auth_ldap_close_connection(lconn);
+            lconn = NULL;
+        }
+
+        if (lconn != NULL && mconf->async && ngx_http_auth_ldap_add_connection(lconn) != NGX_OK) {
+            ngx_http_auth_ldap_close_connection(lconn);
+            lconn = NULL;
+        }
+
+        if (lconn != NULL) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "LDAP [%s]: prewarmed connection", server->url.data);
+
+            // Result of the bind is read by idle handler or by the first request using the connection
+            lconn->idle_since = ngx_current_msec;
+            if (lconn->conn != NULL) {
+                lconn->conn->idle = 1;
+                ngx_add_timer(lconn->conn->read, server->keepalive_timeout);
+            }
+            ngx_queue_insert_tail(&server->free_connections, &lconn->queue);
+
+            if (n + 1 < server->prewarm) {
+                delay = ngx_max(NGX_HTTP_AUTH_LDAP_PREWARM_SPREAD / server->prewarm, 1);
+            }
+
+        } else {
+            delay = (ngx_msec_t) server->fail_timeout * 1000;
+        }
+    }
+
+    ngx_add_timer(ev, delay);
+}
+
+/**
+ * Returns number of idle connections to the server, expired ones which are not polled by event loop are closed
+ */
+static ngx_uint_t
+ngx_http_auth_ldap_free_connections(ngx_ldap_server *server)
+{
+    ngx_http_auth_ldap_connection_t *lconn;
+    ngx_queue_t *q, *next;
+    ngx_uint_t n;
+
+    n = 0;
+    for (q = ngx_queue_head(&server->free_connections);
+         q != ngx_queue_sentinel(&server->free_connections);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        lconn = ngx_queue_data(q, ngx_http_auth_ldap_connection_t, queue);
+
+        if (lconn->conn == NULL && ngx_current_msec - lconn->idle_since >= server->keepalive_timeout) {
+            ngx_queue_remove(q);
+            ngx_http_auth_ldap_close_connection(lconn);
+            continue;
+        }
+
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Continue authentication once its connection has made progress
+ */
+static void
+ngx_http_auth_ldap_resume(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_http_auth_ldap_ctx_t *main = ctx->main;
+
+    if (!main->background) {
+        ngx_http_auth_ldap_wake_request(ctx->r);
+        return;
+    }
+
+    if (ngx_http_auth_ldap_process_all(main) != NGX_AGAIN) {
+        // Cleanup handlers of the pool release connections of the refresh
+        ngx_destroy_pool(main->pool);
+    }
+}
+
+/**
+ * Continue processing of the request suspended in access phase
+ */
+static void
+ngx_http_auth_ldap_wake_request(ngx_http_request_t *r)
+{
+    ngx_connection_t *c = r->connection;
+
+    ngx_http_core_run_phases(r);
+    ngx_http_run_posted_requests(c);
+}
+
+/**
+ * Take idle connection to the server from keepalive pool
+ */
+static ngx_http_auth_ldap_connection_t *
+ngx_http_auth_ldap_get_cached_connection(ngx_ldap_server *server, ngx_log_t *log)
+{
+    ngx_http_auth_ldap_connection_t *lconn;
+    ngx_queue_t *q;
+    ngx_connection_t *c;
+
+    while (!ngx_queue_empty(&server->free_connections)) {
+        q = ngx_queue_head(&server->free_connections);
+        ngx_queue_remove(q);
+        lconn = ngx_queue_data(q, ngx_http_auth_ldap_connection_t, queue);
+
+        // Connections which are not in event loop can't be closed by timer
+        if (ngx_current_msec - lconn->idle_since >= server->keepalive_timeout) {
+            ngx_http_auth_ldap_close_connection(lconn);
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "LDAP [%s]: using cached connection", server->url.data);
+
+        lconn->log = log;
+        lconn->reused = 1;
+
+        c = lconn->conn;
+        if (c != NULL) {
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+            c->idle = 0;
+            c->log = log;
+            c->read->log = log;
+            c->write->log = log;
+        }
+
+        return lconn;
+    }
+
+    return NULL;
+}
+
+/**
+ * Detach connection from the request and put it to keepalive pool if it can be reused, close it otherwise
+ */
+static void
+ngx_http_auth_ldap_release_connection(ngx_http_auth_ldap_ctx_t *ctx, ngx_flag_t keep)
+{
+    ngx_http_auth_ldap_connection_t *lconn = ctx->lconn;
+    ngx_ldap_server *server;
+    ngx_connection_t *c;
+    ngx_uint_t n;
+
+    if (lconn == NULL) {
+        return;
+    }
+
+    if (ctx->result != NULL) {
+        ldap_msgfree(ctx->result);
+        ctx->result = NULL;
+    }
+
+    // Operation is still in flight (request finalized while waiting)
+    if (ctx->waiting) {
+        keep = 0;
+        ctx->waiting = 0;
+    }
+
+    ctx->lconn = NULL;
+    lconn->rctx = NULL;
+    server = lconn->server;
+
+    // Stale keepalive connection does not mean that the server is down
+    if (lconn->broken && !lconn->reused) {
+        ngx_http_auth_ldap_server_health(ctx, server, 1, ctx->error != LDAP_SUCCESS ? ctx->error : LDAP_SERVER_DOWN);
+    }
+
+    if (!keep || lconn->broken || server->keepalive == 0) {
+        ngx_http_auth_ldap_close_connection(lconn);
+        return;
+    }
+
+    n = ngx_http_auth_ldap_free_connections(server);
+
+    if (n >= server->keepalive) {
+        ngx_http_auth_ldap_close_connection(lconn);
+        return;
+    }
+
+    // Connection is bound as the user now, switch it back to service account so next request can search
+    if (lconn->user_bound && ngx_http_auth_ldap_service_bind(lconn) != LDAP_SUCCESS) {
+        ngx_http_auth_ldap_close_connection(lconn);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, lconn->log, 0, "LDAP [%s]: keeping connection alive", server->url.data);
+
+    lconn->log = ngx_cycle->log;
+    lconn->idle_since = ngx_current_msec;
+
+    c = lconn->conn;
+    if (c != NULL) {
+        c->idle = 1;
+        c->log = ngx_cycle->log;
+        c->read->log = ngx_cycle->log;
+        c->write->log = ngx_cycle->log;
+        ngx_add_timer(c->read, server->keepalive_timeout);
+    }
+
+    ngx_queue_insert_head(&server->free_connections, &lconn->queue);
+}
+
+/**
+ * Unbind and close LDAP connection
+ */
+static void
+ngx_http_auth_ldap_close_connection(ngx_http_auth_ldap_connection_t *lconn)
+{
+    ngx_connection_t *c;
+
+#if (NGX_THREADS)
+    // ld is still used by thread pool task, connection is closed once it is over
+    if (lconn->task_busy) {
+        return;
+    }
+#endif
+
+    c = lconn->conn;
+    if (c != NULL) {
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+        if (c->read->posted) {
+            ngx_delete_posted_event(c->read);
+        }
+        if (c->write->posted) {
+            ngx_delete_posted_event(c->write);
+        }
+
+        // Socket itself is closed by ldap_unbind_ext() below
+        if (ngx_del_conn) {
+            ngx_del_conn(c, NGX_CLOSE_EVENT);
+        } else {
+            if (c->read->active) {
+                ngx_del_event(c->read, NGX_READ_EVENT, NGX_CLOSE_EVENT);
+            }
+            if (c->write->active) {
+                ngx_del_event(c->write, NGX_WRITE_EVENT, NGX_CLOSE_EVENT);
+            }
+        }
+
+        c->read->closed = 1;
+        c->write->closed = 1;
+        ngx_free_connection(c);
+        c->fd = (ngx_socket_t) -1;
+        lconn->conn = NULL;
+    }
+
+    ldap_unbind_ext(lconn->ld, NULL, NULL);
+#if (NGX_THREADS)
+    if (lconn->task != NULL) {
+        ngx_free(lconn->task);
+    }
+#endif
+    ngx_free(lconn);
+}
+
+/**
+ * Request pool cleanup handler
+ */
+static void
+ngx_http_auth_ldap_ctx_cleanup(void *data)
+{
+    ngx_http_auth_ldap_ctx_t *ctx = data;
+
+    if (ctx->hedge_timer.timer_set) {
+        ngx_del_timer(&ctx->hedge_timer);
+    }
+
+    if (ctx->wake_event.posted) {
+        ngx_delete_posted_event(&ctx->wake_event);
+    }
+
+    if (ctx->leader != NULL) {
+        ngx_queue_remove(&ctx->flight);
+        ctx->leader = NULL;
+    }
+
+    // Followers of finalized request have to authenticate themselves
+    ngx_http_auth_ldap_land_flight(ctx, NGX_DECLINED);
+
+    ngx_http_auth_ldap_release_connection(ctx, 0);
+}
+
+/**
+ * Respond with forbidden and add correct headers
+ */
+static ngx_int_t ngx_http_auth_ldap_set_realm(ngx_http_request_t *r, ngx_str_t *realm) {
+    r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers);
+    if (r->headers_out.www_authenticate == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.www_authenticate->hash = 1;
+    r->headers_out.www_authenticate->key.len = sizeof("WWW-Authenticate") - 1;
+    r->headers_out.www_authenticate->key.data = (u_char *) "WWW-Authenticate";
+    r->headers_out.www_authenticate->value = *realm;
+
+    return NGX_HTTP_UNAUTHORIZED;
+}
+
+/**
+ * Content handler of auth_ldap_status location
+ */
+static ngx_int_t
+ngx_http_auth_ldap_status_handler(ngx_http_request_t *r)
+{
+    ngx_http_auth_ldap_loc_conf_t *alcf;
+    ngx_http_auth_ldap_conf_t *mconf;
+    ngx_ldap_server *servers;
+    ngx_shm_zone_t **zones;
+    ngx_chain_t out;
+    ngx_buf_t *b;
     ngx_uint_t i;
-    struct berval bvalue;
-    ngx_flag_t pass = NGX_CONF_UNSET;
-    struct timeval timeOut = { 10, 0 };
+    ngx_int_t rc;
+    size_t size;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_auth_ldap_module);
+    mconf = ngx_http_get_module_main_conf(r, ngx_http_auth_ldap_module);
+
+    // Names are written escaped, so leave room for that
+    size = 1024;
+    if (mconf->servers != NULL && mconf->health_zone != NULL) {
+        servers = mconf->servers->elts;
+        for (i = 0; i < mconf->servers->nelts; i++) {
+            size += 4096 + 32 * (servers[i].alias.len + servers[i].url.len);
+        }
+    }
+    zones = mconf->caches->elts;
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        size += 2048 + 32 * zones[i]->shm.name.len;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (alcf->status_format == NGX_HTTP_AUTH_LDAP_STATUS_PROMETHEUS) {
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+        b->last = ngx_http_auth_ldap_status_prometheus(mconf, b->last, b->end);
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+        b->last = ngx_http_auth_ldap_status_json(mconf, b->last, b->end);
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * Write statistics as JSON object with "servers" and "caches" keyed by their names
+ */
+static u_char *
+ngx_http_auth_ldap_status_json(ngx_http_auth_ldap_conf_t *mconf, u_char *p, u_char *last)
+{
+    ngx_ldap_server *servers;
+    ngx_http_auth_ldap_health_t *health;
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_shm_zone_t **zones;
+    ngx_uint_t i, k;
+    size_t used;
+
+    p = ngx_slprintf(p, last, "{\"servers\":{");
+
+    if (mconf->servers != NULL && mconf->health_zone != NULL) {
+        servers = mconf->servers->elts;
+        for (i = 0; i < mconf->servers->nelts; i++) {
+            health = servers[i].health;
+
+            p = ngx_slprintf(p, last, "%s\"", i ? "," : "");
+            p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+            p = ngx_slprintf(p, last, "\":{\"url\":\"");
+            p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].url);
+            p = ngx_slprintf(p, last, "\",\"state\":\"%s\",\"fails\":%ui,\"last_error\":%d,\"operations\":{",
+                ngx_http_auth_ldap_server_state(&servers[i]), health->fails, health->last_error);
+
+            for (k = 0; k < NGX_HTTP_AUTH_LDAP_OPS; k++) {
+                p = ngx_slprintf(p, last, "%s\"%s\":%uA", k ? "," : "", ngx_http_auth_ldap_op_names[k],
+                    health->stats.ops[k]);
+            }
+
+            p = ngx_slprintf(p, last, "},\"errors\":%uA,\"timeouts\":%uA,\"latency\":{\"sum_ms\":%uA,\"buckets\":{",
+                health->stats.errors, health->stats.timeouts, health->stats.latency_sum);
+
+            for (k = 0; k < NGX_HTTP_AUTH_LDAP_LATENCY_BUCKETS - 1; k++) {
+                p = ngx_slprintf(p, last, "\"%M\":%uA,", ngx_http_auth_ldap_latency_buckets[k], health->stats.latency[k]);
+            }
+
+            p = ngx_slprintf(p, last, "\"+Inf\":%uA}}}", health->stats.latency[k]);
+        }
+    }
+
+    p = ngx_slprintf(p, last, "},\"caches\":{");
+
+    zones = mconf->caches->elts;
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        cache = zones[i]->data;
+        used = zones[i]->shm.size - cache->shpool->pfree * ngx_pagesize;
+
+        p = ngx_slprintf(p, last, "%s\"", i ? "," : "");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\":{\"size\":%uz,\"used\":%uz,\"hits\":%uA,\"stale_hits\":%uA,"
+            "\"negative_hits\":%uA,\"misses\":%uA,\"evictions\":%uA,\"expired\":%uA,\"records\":{",
+            zones[i]->shm.size, used, cache->sh->stats.hits, cache->sh->stats.stale_hits, cache->sh->stats.negative_hits,
+            cache->sh->stats.misses, cache->sh->stats.evictions, cache->sh->stats.expired);
+
+        for (k = 0; k < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; k++) {
+            p = ngx_slprintf(p, last, "%s\"%s\":%ui", k ? "," : "", ngx_http_auth_ldap_record_names[k],
+                cache->sh->records[k].count);
+        }
+
+        p = ngx_slprintf(p, last, "}}");
+    }
+
+    return ngx_slprintf(p, last, "}}\n");
+}
+
+/**
+ * Write statistics in Prometheus text format, latency is in seconds
+ */
+static u_char *
+ngx_http_auth_ldap_status_prometheus(ngx_http_auth_ldap_conf_t *mconf, u_char *p, u_char *last)
+{
+    ngx_ldap_server *servers;
+    ngx_http_auth_ldap_health_t *health;
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_shm_zone_t **zones;
+    ngx_atomic_uint_t count;
+    ngx_uint_t i, k, n;
+    ngx_msec_t ms;
+
+    n = (mconf->servers != NULL && mconf->health_zone != NULL) ? mconf->servers->nelts : 0;
+    servers = n ? mconf->servers->elts : NULL;
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_server_up gauge\n");
+    for (i = 0; i < n; i++) {
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_server_up{server=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+        p = ngx_slprintf(p, last, "\"} %d\n", ngx_strcmp(ngx_http_auth_ldap_server_state(&servers[i]), "failed") != 0);
+    }
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_server_fails gauge\n");
+    for (i = 0; i < n; i++) {
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_server_fails{server=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+        p = ngx_slprintf(p, last, "\"} %ui\n", servers[i].health->fails);
+    }
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_operations_total counter\n");
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < NGX_HTTP_AUTH_LDAP_OPS; k++) {
+            p = ngx_slprintf(p, last, "nginx_auth_ldap_operations_total{server=\"");
+            p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+            p = ngx_slprintf(p, last, "\",op=\"%s\"} %uA\n", ngx_http_auth_ldap_op_names[k],
+                servers[i].health->stats.ops[k]);
+        }
+    }
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_errors_total counter\n");
+    for (i = 0; i < n; i++) {
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_errors_total{server=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+        p = ngx_slprintf(p, last, "\"} %uA\n", servers[i].health->stats.errors);
+    }
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_timeouts_total counter\n");
+    for (i = 0; i < n; i++) {
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_timeouts_total{server=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+        p = ngx_slprintf(p, last, "\"} %uA\n", servers[i].health->stats.timeouts);
+    }
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_latency_seconds histogram\n");
+    for (i = 0; i < n; i++) {
+        health = servers[i].health;
+        count = 0;
+
+        for (k = 0; k < NGX_HTTP_AUTH_LDAP_LATENCY_BUCKETS; k++) {
+            count += health->stats.latency[k];
+
+            p = ngx_slprintf(p, last, "nginx_auth_ldap_latency_seconds_bucket{server=\"");
+            p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+
+            if (k < NGX_HTTP_AUTH_LDAP_LATENCY_BUCKETS - 1) {
+                ms = ngx_http_auth_ldap_latency_buckets[k];
+                p = ngx_slprintf(p, last, "\",le=\"%M.%03M\"} %uA\n", ms / 1000, ms % 1000, count);
+            } else {
+                p = ngx_slprintf(p, last, "\",le=\"+Inf\"} %uA\n", count);
+            }
+        }
+
+        ms = health->stats.latency_sum;
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_latency_seconds_sum{server=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+        p = ngx_slprintf(p, last, "\"} %M.%03M\n", ms / 1000, ms % 1000);
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_latency_seconds_count{server=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &servers[i].alias);
+        p = ngx_slprintf(p, last, "\"} %uA\n", count);
+    }
+
+    zones = mconf->caches->elts;
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_cache_lookups_total counter\n");
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        cache = zones[i]->data;
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_lookups_total{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\",result=\"hit\"} %uA\n", cache->sh->stats.hits);
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_lookups_total{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\",result=\"stale\"} %uA\n", cache->sh->stats.stale_hits);
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_lookups_total{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\",result=\"negative\"} %uA\n", cache->sh->stats.negative_hits);
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_lookups_total{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\",result=\"miss\"} %uA\n", cache->sh->stats.misses);
+    }
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_cache_evictions_total counter\n");
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        cache = zones[i]->data;
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_evictions_total{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\"} %uA\n", cache->sh->stats.evictions);
+    }
+
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_cache_expired_total counter\n");
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        cache = zones[i]->data;
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_expired_total{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\"} %uA\n", cache->sh->stats.expired);
+    }
 
-    if (server->ludpp == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_cache_records gauge\n");
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        cache = zones[i]->data;
+        for (k = 0; k < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; k++) {
+            p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_records{zone=\"");
+            p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+            p = ngx_slprintf(p, last, "\",kind=\"%s\"} %ui\n", ngx_http_auth_ldap_record_names[k],
+                cache->sh->records[k].count);
+        }
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: URL: %s", server->url.data);
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_cache_size_bytes gauge\n");
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_size_bytes{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\"} %uz\n", zones[i]->shm.size);
+    }
 
-    rc = ldap_initialize(&ld, (const char*) server->url.data);
-    if (rc != LDAP_SUCCESS) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "LDAP: Session initializing failed: %d, %s, (%s)", rc,
-            ldap_err2string(rc), (const char*) server->url.data);
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    p = ngx_slprintf(p, last, "# TYPE nginx_auth_ldap_cache_used_bytes gauge\n");
+    for (i = 0; i < mconf->caches->nelts; i++) {
+        cache = zones[i]->data;
+        p = ngx_slprintf(p, last, "nginx_auth_ldap_cache_used_bytes{zone=\"");
+        p = ngx_http_auth_ldap_status_escape(p, last, &zones[i]->shm.name);
+        p = ngx_slprintf(p, last, "\"} %uz\n", zones[i]->shm.size - cache->shpool->pfree * ngx_pagesize);
     }
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: Session initialized", NULL);
 
-    /// Bind to the server
-    rc = ldap_simple_bind_s(ld, (const char *) server->bind_dn.data, (const char *) server->bind_dn_passwd.data);
-    if (rc != LDAP_SUCCESS) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "LDAP [%s]: ldap_simple_bind_s error: %d, %s", server->url.data, rc,
-            ldap_err2string(rc));
-        ldap_unbind_s(ld);
-        // Do not throw 500 in case connection failure, multiple servers might be used for failover scenario
-        return 0;
+    return p;
+}
+
+/**
+ * Returns circuit breaker state of the server: "up", "failed" or "probing" once fail_timeout has passed
+ */
+static const char *
+ngx_http_auth_ldap_server_state(ngx_ldap_server *server)
+{
+    ngx_http_auth_ldap_health_t *health = server->health;
+
+    if (server->max_fails == 0 || health->fails < server->max_fails) {
+        return "up";
     }
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: Bind successful", NULL);
 
-    /// Create filter for search users by uid
-    filter = ngx_pcalloc(
-        r->pool,
-        (ludpp->lud_filter != NULL ? ngx_strlen(ludpp->lud_filter) : ngx_strlen("(objectClass=*)")) + ngx_strlen("(&(=))")  + ngx_strlen(ludpp->lud_attrs[0])
-               + uinfo->username.len + 1);
+    return ngx_time() < health->open_until ? "failed" : "probing";
+}
 
-    p = ngx_sprintf(filter, "(&%s(%s=%s))", ludpp->lud_filter != NULL ? ludpp->lud_filter : "(objectClass=*)", ludpp->lud_attrs[0], uinfo->username.data);
-    *p = 0;
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: filter %s", (const char*) filter);
+/**
+ * Copy name to status output with quotes and backslashes escaped, it is dropped if there is no room
+ */
+static u_char *
+ngx_http_auth_ldap_status_escape(u_char *p, u_char *last, ngx_str_t *str)
+{
+    size_t len;
 
-    /// Search the directory
-    rc = ldap_search_ext_s(ld, ludpp->lud_dn, ludpp->lud_scope, (const char*) filter, NULL, 0, NULL, NULL, &timeOut, 0,
-        &searchResult);
+    len = str->len + ngx_escape_json(NULL, str->data, str->len);
+    if (len > (size_t) (last - p)) {
+        return p;
+    }
 
-    if (rc != LDAP_SUCCESS) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "LDAP: ldap_search_ext_s: %d, %s", rc, ldap_err2string(rc));
-        ldap_msgfree(searchResult);
-        ldap_unbind_s(ld);
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    return (u_char *) ngx_escape_json(p, str->data, str->len);
+}
+
+/**
+ * Checksum of the list of ldap servers, shared data refers to servers by index
+ */
+static uint32_t
+ngx_http_auth_ldap_servers_crc(ngx_http_auth_ldap_conf_t *mconf)
+{
+    ngx_ldap_server *servers;
+    ngx_uint_t i;
+    uint32_t crc;
+
+    ngx_crc32_init(crc);
+    if (mconf->servers != NULL) {
+        servers = mconf->servers->elts;
+        for (i = 0; i < mconf->servers->nelts; i++) {
+            ngx_crc32_update(&crc, servers[i].alias.data, servers[i].alias.len + 1);
+        }
     }
+    ngx_crc32_final(crc);
 
-    if (ldap_count_entries(ld, searchResult) > 0) {
-    dn = ldap_get_dn(ld, searchResult);
-        if (dn != NULL) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: result DN %s", dn);
-
-            /// Check require user
-            if (server->require_user != NULL) {
-                value = server->require_user->elts;
-                for (i = 0; i < server->require_user->nelts; i++) {
-                    ngx_str_t val;
-                    if (value[i].lengths == NULL) {
-                        val = value[i].value;
-                    } else {
-                        if (ngx_http_script_run(r, &val, value[i].lengths->elts, 0,
-                            value[i].values->elts) == NULL)
-                        {
-                            ldap_memfree(dn);
-                            ldap_msgfree(searchResult);
-                            ldap_unbind_s(ld);
-                            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                        }
-                        val.data[val.len] = '\0';
-                    }
-
-                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: compare with: %s", val.data);
-                    if (ngx_strncmp(val.data, dn, val.len) == 0) {
-                        pass = 1;
-                        if (server->satisfy_all == 0) {
-                            break;
-                        }
-                    } else {
-                        if (server->satisfy_all == 1) {
-                            ldap_memfree(dn);
-                            ldap_msgfree(searchResult);
-                            ldap_unbind_s(ld);
-                            return 0;
-                        }
-                    }
-                }
-            }
+    return crc;
+}
 
-            /// Check require group
-            if (server->require_group != NULL) {
-                if (server->group_attribute_dn == 1) {
-                    bvalue.bv_val = dn;
-                    bvalue.bv_len = ngx_strlen(dn);
-                } else {
-                    bvalue.bv_val = (char*) uinfo->username.data;
-                    bvalue.bv_len = uinfo->username.len;
-                }
+/**
+ * Init shared memory zone with health of servers, it is kept over reload if servers are the same
+ */
+static ngx_int_t
+ngx_http_auth_ldap_init_health_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_auth_ldap_conf_t *mconf = shm_zone->data;
+    ngx_http_auth_ldap_health_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_ldap_server *servers;
+    ngx_uint_t i, n;
+    uint32_t crc;
+    size_t size;
 
-                value = server->require_group->elts;
-
-                for (i = 0; i < server->require_group->nelts; i++) {
-                    ngx_str_t val;
-                    if (value[i].lengths == NULL) {
-                        val = value[i].value;
-                    } else {
-                        if (ngx_http_script_run(r, &val, value[i].lengths->elts, 0,
-                            value[i].values->elts) == NULL)
-                        {
-                            ldap_memfree(dn);
-                            ldap_msgfree(searchResult);
-                            ldap_unbind_s(ld);
-                            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                        }
-                        val.data[val.len] = '\0';
-                    }
-
-                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: group compare with: %s", val.data);
-
-                    rc = ldap_compare_ext_s(ld, (const char*) val.data, (const char*) server->group_attribute.data,
-                        &bvalue, NULL, NULL);
-
-                    /*if (rc != LDAP_COMPARE_TRUE && rc != LDAP_COMPARE_FALSE && rc != LDAP_NO_SUCH_ATTRIBUTE ) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "LDAP: ldap_search_ext_s: %d, %s", rc,
-                            ldap_err2string(rc));
-                    ldap_memfree(dn);
-                    ldap_msgfree(searchResult);
-                    ldap_unbind_s(ld);
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                    }*/
-
-                    if (rc == LDAP_COMPARE_TRUE) {
-                        pass = 1;
-                        if (server->satisfy_all == 0) {
-                            break;
-                        }
-                    } else {
-                        if (server->satisfy_all == 1) {
-                            pass = 0;
-                            break;
-                        }
-                    }
-                }
-            }
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    servers = mconf->servers->elts;
+    n = mconf->servers->nelts;
+    crc = ngx_http_auth_ldap_servers_crc(mconf);
 
-            /// Check valid user
-            if ( pass != 0 || (server->require_valid_user == 1 && server->satisfy_all == 0 && pass == 0)) {
-                /// Bind user to the server
-                rc = ldap_simple_bind_s(ld, dn, (const char *) uinfo->password.data);
-                if (rc != LDAP_SUCCESS) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "LDAP: ldap_simple_bind_s error: %d, %s", rc,
-                        ldap_err2string(rc));
-                    pass = 0;
-                } else {
-                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "LDAP: User bind successful", NULL);
-                    if (server->require_valid_user == 1) pass = 1;
-                }
-            }
+    sh = (data != NULL || shm_zone->shm.exists) ? shpool->data : NULL;
+
+    if (sh != NULL && (sh->servers_crc != crc || sh->nservers != n)) {
+        ngx_slab_free(shpool, sh);
+        sh = NULL;
+    }
 
+    if (sh == NULL) {
+        size = offsetof(ngx_http_auth_ldap_health_shctx_t, servers) + n * sizeof(ngx_http_auth_ldap_health_t);
+        sh = ngx_slab_alloc(shpool, size);
+        if (sh == NULL) {
+            return NGX_ERROR;
         }
-        ldap_memfree(dn);
+        ngx_memzero(sh, size);
+        sh->servers_crc = crc;
+        sh->nservers = n;
+        shpool->data = sh;
     }
 
-    ldap_msgfree(searchResult);
-    ldap_unbind_s(ld);
+    for (i = 0; i < n; i++) {
+        servers[i].health = &sh->servers[i];
+    }
 
-    return pass;
+    return NGX_OK;
 }
 
 /**
- * Respond with forbidden and add correct headers
+ * Check if server may be queried: it has not failed max_fails times in a row, or fail_timeout has passed
+ * and nobody else is probing it
  */
-static ngx_int_t ngx_http_auth_ldap_set_realm(ngx_http_request_t *r, ngx_str_t *realm) {
-    r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers);
-    if (r->headers_out.www_authenticate == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+static ngx_flag_t
+ngx_http_auth_ldap_server_available(ngx_http_auth_ldap_ctx_t *ctx, ngx_ldap_server *server)
+{
+    ngx_http_auth_ldap_health_t *health = server->health;
+    ngx_slab_pool_t *shpool;
+    ngx_flag_t available;
+    time_t now;
+
+    if (server->max_fails == 0 || health == NULL || health->fails < server->max_fails) {
+        return 1;
     }
 
-    r->headers_out.www_authenticate->hash = 1;
-    r->headers_out.www_authenticate->key.len = sizeof("WWW-Authenticate") - 1;
-    r->headers_out.www_authenticate->key.data = (u_char *) "WWW-Authenticate";
-    r->headers_out.www_authenticate->value = *realm;
+    shpool = (ngx_slab_pool_t *) ctx->mconf->health_zone->shm.addr;
+    now = ngx_time();
+    available = 0;
 
-    return NGX_HTTP_UNAUTHORIZED;
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (health->fails < server->max_fails) {
+        available = 1;
+    } else if (now >= health->open_until && now >= health->probe_until) {
+        // Half-open: this request probes the server, the others keep skipping it
+        health->probe_until = now + server->fail_timeout;
+        available = 1;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (available) {
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0, "LDAP [%s]: probing failed server", server->url.data);
+    } else {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP [%s]: server is marked failed, skipping",
+            server->url.data);
+    }
+
+    return available;
 }
 
 /**
- * Init shared memory zone
+ * Record result of communication with the server, failed is set if server did not respond properly
  */
-static ngx_int_t
-ngx_http_auth_ldap_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
+static void
+ngx_http_auth_ldap_server_health(ngx_http_auth_ldap_ctx_t *ctx, ngx_ldap_server *server, ngx_flag_t failed, int error)
 {
-    ngx_slab_pool_t                *shpool;
-    ngx_rbtree_t                   *tree;
-    ngx_rbtree_node_t              *sentinel;
-    ngx_atomic_t                   *lock;
-    if (data) {
-        shm_zone->data = data;
-        return NGX_OK;
+    ngx_http_auth_ldap_health_t *health = server->health;
+    ngx_slab_pool_t *shpool;
+
+    if (health == NULL || (!failed && health->fails == 0)) {
+        return;
     }
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-    tree = ngx_slab_alloc(shpool, sizeof *tree);
-    if (tree == NULL) {
-        return NGX_ERROR;
+    shpool = (ngx_slab_pool_t *) ctx->mconf->health_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (!failed) {
+        health->fails = 0;
+        health->open_until = 0;
+        health->probe_until = 0;
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
     }
 
-    sentinel = ngx_slab_alloc(shpool, sizeof *sentinel);
-    if (sentinel == NULL) {
-        return NGX_ERROR;
+    health->fails++;
+    health->last_error = error;
+
+    if (server->max_fails == 0 || health->fails < server->max_fails) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
     }
 
-    ngx_rbtree_init(tree, sentinel, ngx_http_auth_ldap_rbtree_insert);
-    shm_zone->data = tree;
-    ngx_http_auth_ldap_rbtree = tree;
+    health->open_until = ngx_time() + server->fail_timeout;
+    health->probe_until = 0;
 
+    ngx_shmtx_unlock(&shpool->mutex);
 
-    lock = ngx_slab_alloc(shpool, sizeof(ngx_atomic_t));
-    if (lock == NULL) {
-        return NGX_ERROR;
-    }
-    ngx_http_auth_ldap_cleanup_lock = lock;
+    ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "LDAP [%s]: server failed %ui times in a row, skipping it for %T s",
+        server->url.data, server->max_fails, server->fail_timeout);
+}
 
-    return NGX_OK;
+/**
+ * Init shared memory zone
+ */
+static ngx_int_t
+ngx_http_auth_ldap_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_auth_ldap_cache_t *cache = shm_zone->data;
+
+    // records refer to ldap_server by index, so they are valid only for the same list of servers
+    return ngx_http_auth_ldap_cache_init(shm_zone, data, ngx_http_auth_ldap_servers_crc(cache->data));
 }
 
 /**
- * Insert new node into rbtree
+ * Cleanup handler for ldap authentication cache
  */
-static void
-ngx_http_auth_ldap_rbtree_insert(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+void ngx_http_auth_ldap_cleanup(ngx_event_t *ev){
+  ngx_connection_t *dummy = ev->data;
+  ngx_cycle_t *cycle = dummy->data;
+  ngx_http_auth_ldap_conf_t *mconf;
+  ngx_shm_zone_t **zones;
+  ngx_http_auth_ldap_cache_t *cache;
+  ngx_uint_t i;
+
+  if (ngx_exiting) {
+    return;
+  }
+
+  ngx_add_timer(ev, NGX_HTTP_AUTH_LDAP_CLEANUP_INTERVAL);
+
+  mconf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_auth_ldap_module);
+  zones = mconf->caches->elts;
 
-    ngx_rbtree_generic_insert(temp, node, sentinel, ngx_http_auth_ldap_rbtree_cmp);
+  for (i = 0; i < mconf->caches->nelts; i++) {
+    cache = zones[i]->data;
+
+    // every worker ticks, but each zone is expired by one of them once per interval
+    if (ngx_trylock(&cache->sh->cleanup_lock)){
+      if ((ngx_msec_int_t) (ngx_current_msec - cache->sh->next_cleanup) >= 0) {
+        if (ngx_http_auth_ldap_cache_expire(cache, ev->log) == NGX_OK) {
+          cache->sh->next_cleanup = ngx_current_msec + NGX_HTTP_AUTH_LDAP_CLEANUP_INTERVAL;
+        }
+      }
+      ngx_unlock(&cache->sh->cleanup_lock);
+    }
+  }
 }
 
 /**
- * Find rbtree nodes by key
+ * Builds record key from index of the server and length prefixed parts
  */
-static ngx_rbtree_node_t *
-ngx_http_auth_ldap_rbtree_find(ngx_rbtree_key_t key, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel){
+static ngx_int_t
+ngx_http_auth_ldap_cache_key(ngx_pool_t *pool, ngx_http_auth_ldap_cache_t *cache, ngx_ldap_server *server,
+    ngx_str_t *parts, ngx_uint_t n, ngx_str_t *key)
+{
+    ngx_uint_t i, index;
+    size_t size;
+    u_char *p;
+
+    index = server - (ngx_ldap_server *) ((ngx_http_auth_ldap_conf_t *) cache->data)->servers->elts;
 
-    if (node==sentinel) return NULL;
+    size = 2;
+    for (i = 0; i < n; i++) {
+        size += 2 + parts[i].len;
+    }
+
+    // record lengths are stored as u_short
+    if (index > 0xffff || size > 0xffff) {
+        return NGX_DECLINED;
+    }
 
-    ngx_rbtree_node_t *found = (node->key==key) ? node : NULL;
-    if (found==NULL && node->left != sentinel){
-        found = ngx_http_auth_ldap_rbtree_find(key, node->left, sentinel);
+    p = ngx_pnalloc(pool, size);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
-    if (found==NULL && node->right != sentinel){
-        found = ngx_http_auth_ldap_rbtree_find(key, node->right, sentinel);
+
+    key->data = p;
+    key->len = size;
+
+    *p++ = (u_char) (index >> 8);
+    *p++ = (u_char) index;
+
+    for (i = 0; i < n; i++) {
+        *p++ = (u_char) (parts[i].len >> 8);
+        *p++ = (u_char) parts[i].len;
+        p = ngx_cpymem(p, parts[i].data, parts[i].len);
     }
 
-    return found;
+    return NGX_OK;
 }
 
 /**
- * Compare rbtree nodes
+ * Returns part of cache key which limits where the credentials are valid
  */
-static int
-ngx_http_auth_ldap_rbtree_cmp(const ngx_rbtree_node_t *v_left,
-    const ngx_rbtree_node_t *v_right)
+static void
+ngx_http_auth_ldap_cache_scope(ngx_str_t *addr, ngx_http_auth_ldap_cache_t *cache, ngx_str_t *scope)
 {
-    if (v_left->key == v_right->key) return 0;
-    else return (v_left->key < v_right->key) ? -1 : 1;
+    if (cache->scope_addr) {
+        *scope = *addr;
+    } else {
+        scope->len = 0;
+        scope->data = NULL;
+    }
 }
 
 /**
- * Insert new node into rbtree
+ * Looks up cached authentication of the user against servers of the location.
+ * Returns NGX_OK if any server has accepted the credentials, NGX_HTTP_UNAUTHORIZED if all of them
+ * have recently refused them and NGX_DECLINED otherwise. Sets stale flags if accepting record has
+ * expired, but is still in its grace period, and the server whose record has decided.
  */
-static void
-ngx_rbtree_generic_insert(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel,
-    int (*compare)(const ngx_rbtree_node_t *left, const ngx_rbtree_node_t *right))
+static ngx_int_t
+ngx_http_auth_ldap_cache_lookup(ngx_http_request_t *r, ngx_http_auth_ldap_cache_t *cache,
+    ngx_http_auth_ldap_loc_conf_t *conf, ngx_http_auth_ldap_conf_t *mconf, ngx_ldap_userinfo *uinfo, ngx_uint_t *stale,
+    ngx_ldap_server **server)
 {
-    for ( ;; ) {
-        if (node->key < temp->key) {
+    ngx_ldap_server **servers;
+    ngx_str_t parts[3], key, negative_key;
+    ngx_uint_t i, refused;
+    ngx_http_auth_ldap_node_t *node;
+    u_char hash[SHA_DIGEST_LENGTH+1];
+    time_t now;
 
-            if (temp->left == sentinel) {
-                temp->left = node;
-                break;
-            }
+    *stale = 0;
 
-            temp = temp->left;
+    if (conf->ldap_servers == NULL) {
+        return NGX_DECLINED;
+    }
 
-        } else if (node->key > temp->key) {
+    // Hash is calculated before taking the lock to keep it short
+    ngx_http_auth_ldap_get_password_hash(&uinfo->username, &uinfo->password, hash);
 
-            if (temp->right == sentinel) {
-                temp->right = node;
-                break;
-            }
+    parts[0] = uinfo->username;
+    ngx_http_auth_ldap_cache_scope(&r->connection->addr_text, cache, &parts[1]);
+    parts[2].data = hash;
+    parts[2].len = SHA_DIGEST_LENGTH;
 
-            temp = temp->right;
+    servers = conf->ldap_servers->elts;
+    refused = 0;
 
-        } else { /* node->key == temp->key */
-            if (compare(node, temp) < 0) {
+    for (i = 0; i < conf->ldap_servers->nelts; i++) {
+        if (ngx_http_auth_ldap_cache_key(r->pool, cache, servers[i], parts, 2, &key) != NGX_OK
+            || ngx_http_auth_ldap_cache_key(r->pool, cache, servers[i], parts, 3, &negative_key) != NGX_OK)
+        {
+            continue;
+        }
 
-                if (temp->left == sentinel) {
-                    temp->left = node;
-                    break;
-                }
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-                temp = temp->left;
+        node = ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key);
+        now = ngx_time();
 
-            } else {
+        if (node != NULL && ngx_memcmp(hash, node->data + node->key_len, SHA_DIGEST_LENGTH) == 0) {
+            if (now < node->fresh_until) {
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+                ngx_atomic_fetch_add(&cache->sh->stats.hits, 1);
+                *server = servers[i];
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "User %s passed all checks, using cache of server %V to allow access", uinfo->username.data, &servers[i]->alias);
+                return NGX_OK;
+            }
 
-                if (temp->right == sentinel) {
-                    temp->right = node;
-                    break;
+            // Refresh has to run in background, and the result must not depend on the request
+            if (mconf->nonblocking && !conf->variable_requires && now < node->fresh_until + cache->stale_revalidate) {
+                if (node->revalidate_until <= now) {
+                    node->revalidate_until = now + NGX_HTTP_AUTH_LDAP_REVALIDATE_TIMEOUT;
+                    *stale |= NGX_HTTP_AUTH_LDAP_STALE_REVALIDATE;
                 }
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+                ngx_atomic_fetch_add(&cache->sh->stats.stale_hits, 1);
+                *stale |= NGX_HTTP_AUTH_LDAP_STALE_USED;
+                *server = servers[i];
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "User %s passed all checks, using stale cache of server %V to allow access", uinfo->username.data,
+                    &servers[i]->alias);
+                return NGX_OK;
+            }
 
-                temp = temp->right;
+            if (now < node->fresh_until + cache->stale_if_error) {
+                *stale |= NGX_HTTP_AUTH_LDAP_STALE_IF_ERROR;
             }
+
+        } else if (node != NULL) {
+            // Record is left alone, a client guessing the password must not evict the user from cache.
+            // Negative record answers the wrong password, successful bind with new one replaces the record.
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "User %s was found in ldap cache of server %V, but password does not match", uinfo->username.data, &servers[i]->alias);
+        }
+
+        if (cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE]
+            && ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, &negative_key) != NULL)
+        {
+            refused++;
         }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
     }
 
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    if (refused > 0 && refused == conf->ldap_servers->nelts) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+            "LDAP: User %s was recently refused by all servers, using cache to deny access", uinfo->username.data);
+        ngx_atomic_fetch_add(&cache->sh->stats.negative_hits, 1);
+        return NGX_HTTP_UNAUTHORIZED;
+    }
+
+    ngx_atomic_fetch_add(&cache->sh->stats.misses, 1);
+    return NGX_DECLINED;
 }
 
 /**
- * Cleanup handler for ldap authentication cache
+ * Removes positive records of the user for all servers of the location
  */
-void ngx_http_auth_ldap_cleanup(ngx_event_t *ev){
-  if (ev->timer_set) ngx_del_timer(ev);
-  ngx_add_timer(ev, NGX_HTTP_AUTH_LDAP_CLEANUP_INTERVAL);
+static void
+ngx_http_auth_ldap_cache_forget(ngx_http_auth_ldap_ctx_t *ctx, ngx_http_auth_ldap_cache_t *cache,
+    ngx_http_auth_ldap_loc_conf_t *conf, ngx_ldap_userinfo *uinfo)
+{
+    ngx_ldap_server **servers;
+    ngx_str_t parts[2], key;
+    ngx_uint_t i;
 
-  if (ngx_trylock(ngx_http_auth_ldap_cleanup_lock)){
-    ngx_http_auth_ldap_rbtree_prune(ev->log);
-    ngx_unlock(ngx_http_auth_ldap_cleanup_lock);
-  }
+    parts[0] = uinfo->username;
+    ngx_http_auth_ldap_cache_scope(&ctx->addr, cache, &parts[1]);
+
+    servers = conf->ldap_servers->elts;
+    for (i = 0; i < conf->ldap_servers->nelts; i++) {
+        if (ngx_http_auth_ldap_cache_key(ctx->pool, cache, servers[i], parts, 2, &key) == NGX_OK) {
+            ngx_http_auth_ldap_cache_remove(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key);
+        }
+    }
 }
 
 /**
- * Prunes rbtree with ldap authentication cache
+ * Stores successful (or failed if negative is set) ldap authentication to cache
  */
-static void ngx_http_auth_ldap_rbtree_prune(ngx_log_t *log){
-    ngx_uint_t i;
-    time_t now = ngx_time();
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)ngx_http_auth_ldap_shm_zone->shm.addr;
-
-    ngx_shmtx_lock(&shpool->mutex);
-    ngx_http_auth_ldap_cleanup_list->nelts = 0;
-    ngx_http_auth_ldap_rbtree_prune_walk(ngx_http_auth_ldap_rbtree->root, ngx_http_auth_ldap_rbtree->sentinel, now, log);
-
-    ngx_rbtree_node_t **elts = (ngx_rbtree_node_t **)ngx_http_auth_ldap_cleanup_list->elts;
-    for (i=0; i<ngx_http_auth_ldap_cleanup_list->nelts; i++){
-        ngx_rbtree_delete(ngx_http_auth_ldap_rbtree, elts[i]);
-        ngx_slab_free_locked(shpool, elts[i]);
+static void ngx_http_auth_ldap_cache_store(ngx_http_auth_ldap_ctx_t *ctx, ngx_http_auth_ldap_cache_t *cache, ngx_ldap_userinfo *uinfo,
+        ngx_ldap_server *server, ngx_flag_t negative){
+    ngx_str_t                              parts[3], key, value;
+    u_char                                 hash[SHA_DIGEST_LENGTH+1];
+
+    ngx_http_auth_ldap_get_password_hash(&uinfo->username, &uinfo->password, hash);
+
+    parts[0] = uinfo->username;
+    ngx_http_auth_ldap_cache_scope(&ctx->addr, cache, &parts[1]);
+    parts[2].data = hash;
+    parts[2].len = SHA_DIGEST_LENGTH;
+
+    // failed authentications are distinguished by password hash, successful ones keep it as value
+    if (ngx_http_auth_ldap_cache_key(ctx->pool, cache, server, parts, negative ? 3 : 2, &key) != NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0, "LDAP: User %s is too long to be cached", uinfo->username.data);
+        return;
     }
-    ngx_shmtx_unlock(&shpool->mutex);
 
-    // if the cleanup array grew during the run, shrink it back down
-    if (ngx_http_auth_ldap_cleanup_list->nalloc > NGX_HTTP_AUTH_LDAP_CLEANUP_BATCH_SIZE){
-        ngx_array_t *old_list = ngx_http_auth_ldap_cleanup_list;
-        ngx_array_t *new_list = ngx_array_create(old_list->pool, NGX_HTTP_AUTH_LDAP_CLEANUP_BATCH_SIZE, sizeof(ngx_rbtree_node_t *));
-        if (new_list!=NULL){
-            ngx_array_destroy(old_list);
-            ngx_http_auth_ldap_cleanup_list = new_list;
-        } else {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "auth_ldap ran out of cleanup space");
-        }
+    if (negative) {
+        value.data = NULL;
+        value.len = 0;
+        ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, &key, &value, ctx->log);
+    } else {
+        ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key, &parts[2], ctx->log);
     }
 }
 
 /**
- * Walk through the tree and find elements which are expired
+ * Builds key of username to DN record for current server, NGX_DECLINED if DN caching is off
  */
-static void ngx_http_auth_ldap_rbtree_prune_walk(ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel, time_t now, ngx_log_t *log){
-    if (node==sentinel) return;
+static ngx_int_t
+ngx_http_auth_ldap_dn_key(ngx_http_auth_ldap_ctx_t *ctx, ngx_str_t *key)
+{
+    ngx_http_auth_ldap_cache_t *cache;
 
-    if (node->left != sentinel){
-        ngx_http_auth_ldap_rbtree_prune_walk(node->left, sentinel, now, log);
+    if (ctx->conf->cache_zone == NULL) {
+        return NGX_DECLINED;
     }
 
-    if (node->right != sentinel){
-        ngx_http_auth_ldap_rbtree_prune_walk(node->right, sentinel, now, log);
+    cache = ctx->conf->cache_zone->data;
+    if (cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_DN] == 0) {
+        return NGX_DECLINED;
     }
 
-    ngx_http_auth_ldap_node_t *dnode = (ngx_http_auth_ldap_node_t*) node;
-    if (dnode->expires <= ngx_time()){
-        ngx_rbtree_node_t **dropnode = ngx_array_push(ngx_http_auth_ldap_cleanup_list);
-        dropnode[0] = node;
+    // Groups from membership attribute come only with the search result
+    if (ctx->server->membership_attribute.len && ctx->server->require_group != NULL) {
+        return NGX_DECLINED;
     }
+
+    // DN is the same for every client, so the key is not scoped
+    return ngx_http_auth_ldap_cache_key(ctx->pool, cache, ctx->server, &ctx->uinfo->username, 1, key);
 }
 
 /**
- * Returns simple hash key to use in rbtree
+ * Takes DN of the user from cache, so user search can be skipped
  */
-static ngx_uint_t nginx_http_auth_ldap_get_cache_key (ngx_ldap_userinfo *uinfo)
+static ngx_int_t
+ngx_http_auth_ldap_lookup_dn(ngx_http_auth_ldap_ctx_t *ctx)
 {
-    return ngx_crc32_long(uinfo->username.data, uinfo->username.len);
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_http_auth_ldap_node_t *node;
+    ngx_str_t key;
+    ngx_int_t rc;
+
+    rc = ngx_http_auth_ldap_dn_key(ctx, &key);
+    if (rc != NGX_OK) {
+        return rc == NGX_ERROR ? NGX_ERROR : NGX_OK;
+    }
 
-}
+    cache = ctx->conf->cache_zone->data;
 
-/**
- * Stores ldap authentication cache to rbtree
- */
-static ngx_http_auth_ldap_node_t ngx_http_auth_ldap_cache_store(ngx_http_request_t *r, ngx_ldap_userinfo *uinfo, ngx_ldap_server *server){
-    ngx_slab_pool_t                        *shpool;
-    ngx_uint_t                             key;
-    ngx_http_auth_ldap_node_t              *node;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    shpool = (ngx_slab_pool_t *)ngx_http_auth_ldap_shm_zone->shm.addr;
+    node = ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key);
+    if (node != NULL) {
+        ctx->dn = ngx_pnalloc(ctx->pool, node->value_len + 1);
+        if (ctx->dn == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+        ngx_memcpy(ctx->dn, node->data + node->key_len, node->value_len);
+        ctx->dn[node->value_len] = '\0';
+        ctx->dn_cached = 1;
+    }
 
-    // create a cache record
-    key = nginx_http_auth_ldap_get_cache_key(uinfo);
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_http_auth_ldap_node_t *found = (ngx_http_auth_ldap_node_t *)ngx_http_auth_ldap_rbtree_find(key, ngx_http_auth_ldap_rbtree->root, ngx_http_auth_ldap_rbtree->sentinel);
-	if (found!=NULL){
-        ngx_shmtx_unlock(&shpool->mutex);
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "Trying to store cache which already exist. This is so wrong and looks like hash collision! Username in cache - %s, username provided - %s", found->username, uinfo->username.data);
+    if (ctx->dn_cached) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "LDAP: DN found in cache: %s", ctx->dn);
     }
 
-    node = ngx_slab_alloc_locked(shpool, sizeof(ngx_http_auth_ldap_node_t));
-    if (node==NULL){
-        ngx_shmtx_unlock(&shpool->mutex);
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "auth_ldap ran out of shm space. Increase the auth_digest_shm_size limit.");
-        //TODO: Really?
-        return *node;
-    }
+    return NGX_OK;
+}
 
-    //TODO: make this configurable
-    node->expires = ngx_time() + 300;
-    //node->server_alias = ngx_slab_alloc_locked(shpool, server->alias.len);
-    ngx_memcpy(node->server_alias, server->alias.data, server->alias.len);
-    ngx_memcpy(node->username, uinfo->username.data, uinfo->username.len);
-    ngx_memcpy(node->client_ip, r->connection->addr_text.data, r->connection->addr_text.len);
+/**
+ * Remembers DN found by user search
+ */
+static void
+ngx_http_auth_ldap_store_dn(ngx_http_auth_ldap_ctx_t *ctx)
+{
+    ngx_str_t key, value;
 
-    ngx_http_auth_ldap_get_password_hash(r, &uinfo->username, &uinfo->password, node->password_hash);
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "GET HASH RESULT: %s", node->password_hash);
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "GET HASH RESULT: %d", ngx_strlen(node->password_hash));
+    if (ngx_http_auth_ldap_dn_key(ctx, &key) != NGX_OK) {
+        return;
+    }
 
-    ((ngx_rbtree_node_t *)node)->key = key;
-    ngx_rbtree_insert(ngx_http_auth_ldap_rbtree, &node->node);
+    value.data = (u_char *) ctx->dn;
+    value.len = ngx_strlen(ctx->dn);
 
-    ngx_shmtx_unlock(&shpool->mutex);
-    return *node;
+    ngx_http_auth_ldap_cache_put(ctx->conf->cache_zone->data, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key, &value,
+        ctx->log);
 }
 
-static void ngx_http_auth_ldap_get_password_hash (ngx_http_request_t *r, const ngx_str_t *username, const ngx_str_t *password, u_char *hash)
+/**
+ * Forgets cached DN which the server did not accept
+ */
+static void
+ngx_http_auth_ldap_remove_dn(ngx_http_auth_ldap_ctx_t *ctx)
 {
+    ngx_str_t key;
 
-	 u_char buf[password->len + username->len + sizeof('|')];
-	 u_char *p;
-     p = buf;
+    if (ngx_http_auth_ldap_dn_key(ctx, &key) != NGX_OK) {
+        return;
+    }
 
-	 p = ngx_snprintf(p, sizeof buf, "%s|%s", username->data, password->data);
-	 *p = '\0';
-    SHA1(buf, ngx_strlen(buf), hash);
-    hash[SHA_DIGEST_LENGTH] = '\0';
+    ngx_http_auth_ldap_cache_remove(ctx->conf->cache_zone->data, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key);
 }
 
 static ngx_int_t
 ngx_http_auth_ldap_worker_init(ngx_cycle_t *cycle){
+    ngx_http_auth_ldap_conf_t *mconf;
+    ngx_ldap_server *servers;
+    ngx_uint_t i;
+
     if (ngx_process != NGX_PROCESS_WORKER){
         return NGX_OK;
     }
 
-    // create a cleanup queue big enough for the max number of tree nodes in the shm
-    ngx_http_auth_ldap_cleanup_list = ngx_array_create(cycle->pool,
-                                                      NGX_HTTP_AUTH_LDAP_CLEANUP_BATCH_SIZE,
-                                                      sizeof(ngx_rbtree_node_t *));
-    if (ngx_http_auth_ldap_cleanup_list==NULL){
-        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "Could not allocate shared memory for auth_ldap");
-        return NGX_ERROR;
+    if (ngx_http_cycle_get_module_main_conf(cycle, ngx_http_auth_ldap_module) == NULL) {
+        return NGX_OK;
     }
 
     ngx_connection_t  *dummy;
@@ -1200,7 +4476,108 @@ ngx_http_auth_ldap_worker_init(ngx_cycle_t *cycle){
     ngx_http_auth_ldap_cleanup_timer->log = ngx_cycle->log;
     ngx_http_auth_ldap_cleanup_timer->data = dummy;
     ngx_http_auth_ldap_cleanup_timer->handler = ngx_http_auth_ldap_cleanup;
+    ngx_http_auth_ldap_cleanup_timer->cancelable = 1;
     ngx_add_timer(ngx_http_auth_ldap_cleanup_timer, NGX_HTTP_AUTH_LDAP_CLEANUP_INTERVAL);
+
+    // Connections are opened after a short random delay, so workers do not hit the servers all at once
+    mconf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_auth_ldap_module);
+    if (mconf->servers != NULL) {
+        servers = mconf->servers->elts;
+        for (i = 0; i < mconf->servers->nelts; i++) {
+            if (servers[i].prewarm == 0) {
+                continue;
+            }
+
+            servers[i].prewarm_event.handler = ngx_http_auth_ldap_prewarm_handler;
+            servers[i].prewarm_event.data = &servers[i];
+            servers[i].prewarm_event.log = cycle->log;
+            servers[i].prewarm_event.cancelable = 1;
+            ngx_add_timer(&servers[i].prewarm_event, 1 + ngx_random() % NGX_HTTP_AUTH_LDAP_PREWARM_SPREAD);
+        }
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Register variables describing authentication of the request
+ */
+static ngx_int_t
+ngx_http_auth_ldap_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_auth_ldap_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Get value of a variable, they are not found if the request did not authenticate against LDAP
+ */
+static ngx_int_t
+ngx_http_auth_ldap_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_auth_ldap_ctx_t *ctx;
+    ngx_str_t *value;
+    ngx_msec_t ms;
+    u_char *p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_auth_ldap_module);
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    switch (data) {
+
+    case NGX_HTTP_AUTH_LDAP_VAR_CACHE_STATUS:
+        value = &ngx_http_auth_ldap_cache_statuses[ctx->cache_status];
+        if (value->len == 0) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+        v->data = value->data;
+        v->len = value->len;
+        break;
+
+    case NGX_HTTP_AUTH_LDAP_VAR_SERVER:
+        if (ctx->server_answered == NULL) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+        v->data = ctx->server_answered->alias.data;
+        v->len = ctx->server_answered->alias.len;
+        break;
+
+    default: /* NGX_HTTP_AUTH_LDAP_VAR_TIME, NGX_HTTP_AUTH_LDAP_VAR_OPS */
+        p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (data == NGX_HTTP_AUTH_LDAP_VAR_OPS) {
+            v->len = ngx_sprintf(p, "%ui", ctx->ops) - p;
+        } else {
+            ms = (ctx->phase == NGX_HTTP_AUTH_LDAP_PHASE_DONE ? ctx->finished : ngx_current_msec) - ctx->started;
+            v->len = ngx_sprintf(p, "%M", ms) - p;
+        }
+        v->data = p;
+        break;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
     return NGX_OK;
 }
 
@@ -1210,7 +4587,6 @@ ngx_http_auth_ldap_worker_init(ngx_cycle_t *cycle){
 static ngx_int_t ngx_http_auth_ldap_init(ngx_conf_t *cf) {
     ngx_http_handler_pt *h;
     ngx_http_core_main_conf_t *cmcf;
-    ngx_str_t                  *shm_name;
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
@@ -1226,20 +4602,5 @@ static ngx_int_t ngx_http_auth_ldap_init(ngx_conf_t *cf) {
     return NGX_ERROR;
   }
 
-  shm_name = ngx_palloc(cf->pool, sizeof *shm_name);
-  shm_name->len = sizeof("auth_ldap");
-  shm_name->data = (unsigned char *) "auth_ldap";
-
-  if (ngx_http_auth_ldap_shm_size == 0) {
-    ngx_http_auth_ldap_shm_size = 4 * 256 * ngx_pagesize; // default to 4mb
-  }
-
-  ngx_http_auth_ldap_shm_zone = ngx_shared_memory_add(
-    cf, shm_name, ngx_http_auth_ldap_shm_size, &ngx_http_auth_ldap_module);
-  if (ngx_http_auth_ldap_shm_zone == NULL) {
-    return NGX_ERROR;
-  }
-  ngx_http_auth_ldap_shm_zone->init = ngx_http_auth_ldap_init_shm_zone;
-
   return NGX_OK;
 }
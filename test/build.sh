@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Builds test/cache_test against a configured and built nginx tree, linking
+# the cache with nginx's own slab allocator, shared mutex and rbtree:
+#
+#   cd /path/to/nginx
+#   ./configure --with-http_ssl_module --add-module=/path/to/nginx-auth-ldap
+#   make
+#   /path/to/nginx-auth-ldap/test/build.sh /path/to/nginx
+#
+# Needs nginx 1.14 or newer (ngx_slab_sizes_init).
+
+set -e
+
+test_dir=$(cd "$(dirname "$0")" && pwd)
+module_dir=$(dirname "$test_dir")
+nginx_dir=$(cd "${1:?usage: $0 /path/to/built/nginx}" && pwd)
+makefile="$nginx_dir/objs/Makefile"
+
+if [ ! -f "$nginx_dir/objs/nginx" ]; then
+    echo "$0: $nginx_dir is not a built nginx tree, run ./configure and make first" >&2
+    exit 1
+fi
+
+# value of a Makefile variable, joined over its continuation lines
+make_var() {
+    awk -v var="$1" '
+        $0 ~ "^" var " *=" { on = 1; sub("^" var " *=", "") }
+        on { cont = sub(/\\$/, ""); printf "%s ", $0; if (!cont) exit }
+    ' "$makefile" | tr '\t' ' '
+}
+
+cc=$(make_var CC)
+cflags=$(make_var CFLAGS)
+incs=$(make_var ALL_INCS)
+
+# libraries nginx itself is linked with: the non-object lines of its link command
+libs=$(sed -n '/\$(LINK) -o objs\/nginx/,/^$/p' "$makefile" \
+       | sed -e '1d' -e 's/\\$//' | tr '\n\t' '  ' | tr -s ' ' '\n' | grep -v '\.o$' | tr '\n' ' ')
+
+cd "$nginx_dir"
+
+# everything nginx is made of, with nginx's main() renamed out of the way
+objs=$(find objs -name '*.o' ! -path objs/src/core/nginx.o | sort)
+objcopy --redefine-sym main=ngx_nginx_main objs/src/core/nginx.o "$test_dir/nginx.o"
+
+$cc -c $cflags $incs -I "$module_dir" \
+    -o "$test_dir/ngx_http_auth_ldap_cache_test.o" "$test_dir/ngx_http_auth_ldap_cache_test.c"
+
+$cc -o "$test_dir/cache_test" "$test_dir/ngx_http_auth_ldap_cache_test.o" "$test_dir/nginx.o" $objs $libs
+
+rm -f "$test_dir/ngx_http_auth_ldap_cache_test.o" "$test_dir/nginx.o"
+
+echo "built $test_dir/cache_test"
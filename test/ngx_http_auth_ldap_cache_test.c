@@ -0,0 +1,630 @@
+/**
+ * Tests and micro-benchmarks of the auth_ldap shared memory cache, run on a real slab pool
+ * outside of nginx. Build with test/build.sh, then:
+ *
+ *   cache_test                      unit tests
+ *   cache_test bench [n ...]        lookup, insert, expiry and eviction at n entries (1k, 100k, 1M)
+ *   cache_test contention [p ...]   p forked processes sharing one zone (1, 2, 4, 8)
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_http_auth_ldap_cache.h"
+
+#define CHECK(expr)                                                            \
+    do {                                                                       \
+        if (!(expr)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+#define TEST_KEY_LEN 64
+#define TEST_RECORD_SIZE 320          /* slab chunk of a record with its key and hash, with some slack */
+#define TEST_CONTENTION_ENTRIES 100000
+#define TEST_CONTENTION_OPS 500000    /* per process */
+
+static ngx_uint_t failures;
+static ngx_log_t test_log;
+static ngx_open_file_t test_log_file;
+static ngx_cycle_t test_cycle;
+static ngx_time_t test_time;          /* ngx_time() reads it, so tests can move the clock */
+
+static ngx_http_auth_ldap_cache_t *test_cache_create(size_t size);
+static void test_cache_destroy(ngx_http_auth_ldap_cache_t *cache);
+static void test_key(ngx_str_t *key, u_char *buf, ngx_uint_t n);
+static ngx_flag_t test_find(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_str_t *key);
+static void test_put_n(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_uint_t from, ngx_uint_t n);
+static double test_now(void);
+static void test_advance(time_t sec);
+
+static void test_put_find(void);
+static void test_replace(void);
+static void test_remove(void);
+static void test_expire(void);
+static void test_lru(void);
+static void test_zone_full(void);
+static void test_stale(void);
+static void test_flush(void);
+static void test_password_hash(void);
+
+static void bench(ngx_uint_t n);
+static void contention(ngx_uint_t procs);
+
+int
+main(int argc, char **argv)
+{
+    ngx_uint_t i, n;
+    static ngx_uint_t sizes[] = { 1000, 100000, 1000000 };
+    static ngx_uint_t procs[] = { 1, 2, 4, 8 };
+
+    ngx_pagesize = getpagesize();
+    for (n = ngx_pagesize; n >>= 1; ngx_pagesize_shift++) { /* void */ }
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ngx_pid = ngx_getpid();
+
+    ngx_time_init();
+    test_time = *ngx_cached_time;
+    ngx_cached_time = &test_time;
+
+    test_log_file.fd = ngx_stderr;
+    test_log.file = &test_log_file;
+    test_log.log_level = NGX_LOG_WARN;
+    test_cycle.log = &test_log;
+    ngx_cycle = &test_cycle;
+
+    ngx_slab_sizes_init();
+
+    if (argc > 1 && ngx_strcmp(argv[1], "bench") == 0) {
+        if (argc == 2) {
+            for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                bench(sizes[i]);
+            }
+        }
+        for (i = 2; i < (ngx_uint_t) argc; i++) {
+            bench(ngx_atoi((u_char *) argv[i], ngx_strlen(argv[i])));
+        }
+        return failures ? 1 : 0;
+    }
+
+    if (argc > 1 && ngx_strcmp(argv[1], "contention") == 0) {
+        if (argc == 2) {
+            for (i = 0; i < sizeof(procs) / sizeof(procs[0]); i++) {
+                contention(procs[i]);
+            }
+        }
+        for (i = 2; i < (ngx_uint_t) argc; i++) {
+            contention(ngx_atoi((u_char *) argv[i], ngx_strlen(argv[i])));
+        }
+        return failures ? 1 : 0;
+    }
+
+    test_put_find();
+    test_replace();
+    test_remove();
+    test_expire();
+    test_lru();
+    test_zone_full();
+    test_stale();
+    test_flush();
+    test_password_hash();
+
+    if (failures) {
+        fprintf(stderr, "%lu checks failed\n", (unsigned long) failures);
+        return 1;
+    }
+
+    printf("all tests passed\n");
+    return 0;
+}
+
+/**
+ * Creates cache zone of the given size the way nginx creates shared zones, with module defaults
+ */
+static ngx_http_auth_ldap_cache_t *
+test_cache_create(size_t size)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_shm_zone_t *shm_zone;
+    ngx_slab_pool_t *sp;
+    ngx_uint_t i;
+
+    shm_zone = ngx_calloc(sizeof(ngx_shm_zone_t), &test_log);
+    cache = ngx_calloc(sizeof(ngx_http_auth_ldap_cache_t), &test_log);
+    if (shm_zone == NULL || cache == NULL) {
+        exit(2);
+    }
+
+    ngx_str_set(&shm_zone->shm.name, "test");
+    shm_zone->shm.size = size;
+    shm_zone->shm.log = &test_log;
+    if (ngx_shm_alloc(&shm_zone->shm) != NGX_OK) {
+        exit(2);
+    }
+
+    sp = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sp->end = shm_zone->shm.addr + shm_zone->shm.size;
+    sp->min_shift = 3;
+    sp->addr = shm_zone->shm.addr;
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        exit(2);
+    }
+    ngx_slab_init(sp);
+    // full zone is a normal condition for the cache
+    sp->log_nomem = 0;
+
+    shm_zone->data = cache;
+    cache->shm_zone = shm_zone;
+    for (i = 0; i < NGX_HTTP_AUTH_LDAP_CACHE_KINDS; i++) {
+        cache->ttl[i] = 300;
+    }
+    cache->cleanup_batch = 2048;
+
+    if (ngx_http_auth_ldap_cache_init(shm_zone, NULL, 0) != NGX_OK) {
+        exit(2);
+    }
+
+    return cache;
+}
+
+static void
+test_cache_destroy(ngx_http_auth_ldap_cache_t *cache)
+{
+    ngx_shm_free(&cache->shm_zone->shm);
+    ngx_free(cache->shm_zone);
+    ngx_free(cache);
+}
+
+/**
+ * Key of n-th record, about as long as username and client address of real records
+ */
+static void
+test_key(ngx_str_t *key, u_char *buf, ngx_uint_t n)
+{
+    key->data = buf;
+    key->len = ngx_snprintf(buf, TEST_KEY_LEN, "user%010ui|10.0.%ui.%ui", n, (n >> 8) & 0xff, n & 0xff) - buf;
+}
+
+static ngx_flag_t
+test_find(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_str_t *key)
+{
+    ngx_flag_t found;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    found = ngx_http_auth_ldap_cache_find(cache, kind, key) != NULL;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return found;
+}
+
+/**
+ * Puts records from..from+n-1 with password hash as value, like successful authentications
+ */
+static void
+test_put_n(ngx_http_auth_ldap_cache_t *cache, ngx_uint_t kind, ngx_uint_t from, ngx_uint_t n)
+{
+    u_char buf[TEST_KEY_LEN], hash[SHA_DIGEST_LENGTH + 1];
+    ngx_str_t key, value;
+    ngx_uint_t i;
+
+    ngx_memset(hash, 'h', SHA_DIGEST_LENGTH);
+    value.data = hash;
+    value.len = SHA_DIGEST_LENGTH;
+
+    for (i = from; i < from + n; i++) {
+        test_key(&key, buf, i);
+        ngx_http_auth_ldap_cache_put(cache, kind, &key, &value, &test_log);
+    }
+}
+
+static double
+test_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+test_advance(time_t sec)
+{
+    test_time.sec += sec;
+}
+
+static void
+test_put_find(void)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_http_auth_ldap_node_t *node;
+    ngx_str_t key = ngx_string("key"), value = ngx_string("value");
+
+    cache = test_cache_create(256 * ngx_pagesize);
+
+    ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key, &value, &test_log);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    node = ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key);
+    CHECK(node != NULL);
+    if (node != NULL) {
+        CHECK(node->key_len == key.len && node->value_len == value.len);
+        CHECK(ngx_memcmp(node->data + node->key_len, value.data, value.len) == 0);
+    }
+    // kinds do not share records
+    CHECK(ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &key) == NULL);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_DN].count == 1);
+
+    // many records with colliding prefixes are all found
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 0, 1000);
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE].count == 1000);
+
+    {
+        u_char buf[TEST_KEY_LEN];
+        ngx_uint_t i, found = 0;
+
+        for (i = 0; i < 1000; i++) {
+            test_key(&key, buf, i);
+            found += test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key);
+        }
+        CHECK(found == 1000);
+
+        test_key(&key, buf, 1000);
+        CHECK(!test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key));
+    }
+
+    test_cache_destroy(cache);
+}
+
+static void
+test_replace(void)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_http_auth_ldap_node_t *node;
+    ngx_str_t key = ngx_string("user"), value;
+
+    cache = test_cache_create(256 * ngx_pagesize);
+
+    ngx_str_set(&value, "cn=old,dc=example");
+    ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key, &value, &test_log);
+    ngx_str_set(&value, "cn=new,dc=example");
+    ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key, &value, &test_log);
+    ngx_str_set(&value, "cn=longer name,dc=example");
+    ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key, &value, &test_log);
+
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_DN].count == 1);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    node = ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key);
+    CHECK(node != NULL && node->value_len == value.len
+          && ngx_memcmp(node->data + node->key_len, value.data, value.len) == 0);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    test_cache_destroy(cache);
+}
+
+static void
+test_remove(void)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_str_t key = ngx_string("user"), other = ngx_string("other"), value = ngx_string("1");
+
+    cache = test_cache_create(256 * ngx_pagesize);
+
+    ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &key, &value, &test_log);
+    ngx_http_auth_ldap_cache_remove(cache, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &other);
+    ngx_http_auth_ldap_cache_remove(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, &key);
+    CHECK(test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &key));
+
+    ngx_http_auth_ldap_cache_remove(cache, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &key);
+    CHECK(!test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_GROUP, &key));
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_GROUP].count == 0);
+    CHECK(ngx_queue_empty(&cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_GROUP].lru));
+    CHECK(ngx_queue_empty(&cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_GROUP].expire_queue));
+
+    test_cache_destroy(cache);
+}
+
+static void
+test_expire(void)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    u_char buf[TEST_KEY_LEN];
+    ngx_str_t key;
+
+    cache = test_cache_create(256 * ngx_pagesize);
+    cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE] = 10;
+
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, 0, 3);
+    test_advance(5);
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, 3, 2);
+    test_advance(5);
+
+    // expired record is not found even before it is removed
+    test_key(&key, buf, 0);
+    CHECK(!test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, &key));
+    test_key(&key, buf, 3);
+    CHECK(test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, &key));
+
+    CHECK(ngx_http_auth_ldap_cache_expire(cache, &test_log) == NGX_OK);
+    CHECK(cache->sh->stats.expired == 3);
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE].count == 2);
+
+    // expiry runs in batches
+    cache->cleanup_batch = 2;
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, 10, 3);
+    test_advance(10);
+    CHECK(ngx_http_auth_ldap_cache_expire(cache, &test_log) == NGX_AGAIN);
+    CHECK(ngx_http_auth_ldap_cache_expire(cache, &test_log) == NGX_AGAIN);
+    CHECK(ngx_http_auth_ldap_cache_expire(cache, &test_log) == NGX_OK);
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE].count == 0);
+    CHECK(cache->sh->stats.expired == 8);
+
+    test_cache_destroy(cache);
+}
+
+static void
+test_lru(void)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    u_char buf[TEST_KEY_LEN];
+    ngx_str_t key;
+
+    cache = test_cache_create(256 * ngx_pagesize);
+    cache->max_entries[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE] = 3;
+
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 0, 3);
+
+    // record 0 is used, so record 1 is the least recently used one
+    test_key(&key, buf, 0);
+    CHECK(test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key));
+
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 3, 1);
+
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE].count == 3);
+    CHECK(cache->sh->stats.evictions == 1);
+    CHECK(test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key));
+    test_key(&key, buf, 1);
+    CHECK(!test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key));
+
+    test_cache_destroy(cache);
+}
+
+static void
+test_zone_full(void)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_uint_t positive;
+
+    cache = test_cache_create(16 * ngx_pagesize);
+
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, 0, 50);
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 0, 10000);
+
+    // failed authentications make room first, then the oldest records of the kind
+    positive = cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE].count;
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE].count == 0);
+    CHECK(positive > 0 && positive < 10000);
+    CHECK(cache->sh->stats.evictions == 10000 + 50 - positive);
+
+    // failed authentication never pushes out other records
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, 100, 10);
+    CHECK(cache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE].count == positive);
+
+    test_cache_destroy(cache);
+}
+
+static void
+test_stale(void)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    ngx_http_auth_ldap_node_t *node;
+    u_char buf[TEST_KEY_LEN];
+    ngx_str_t key;
+
+    cache = test_cache_create(256 * ngx_pagesize);
+    cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE] = 10;
+    cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE] = 10;
+    cache->stale_revalidate = 60;
+    cache->stale_if_error = 300;
+
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 0, 1);
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, 0, 1);
+    test_key(&key, buf, 0);
+
+    // positive record is kept for the longer grace period after it stops being fresh
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    node = ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key);
+    CHECK(node != NULL && node->fresh_until == ngx_time() + 10 && node->expires == ngx_time() + 310);
+    node = ngx_http_auth_ldap_cache_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, &key);
+    CHECK(node != NULL && node->expires == ngx_time() + 10);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    test_advance(100);
+    CHECK(test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key));
+    CHECK(!test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_NEGATIVE, &key));
+
+    test_cache_destroy(cache);
+}
+
+static void
+test_flush(void)
+{
+    ngx_http_auth_ldap_cache_t *cache, *ncache;
+    ngx_shm_zone_t shm_zone;
+
+    cache = test_cache_create(256 * ngx_pagesize);
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 0, 10);
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_DN, 0, 10);
+
+    ncache = ngx_calloc(sizeof(ngx_http_auth_ldap_cache_t), &test_log);
+    if (ncache == NULL) {
+        exit(2);
+    }
+    shm_zone = *cache->shm_zone;
+    shm_zone.data = ncache;
+
+    // zone inherited on reload keeps records of the same servers
+    CHECK(ngx_http_auth_ldap_cache_init(&shm_zone, cache, 0) == NGX_OK);
+    CHECK(ncache->sh == cache->sh && ncache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE].count == 10);
+
+    // and drops them if the servers have changed
+    CHECK(ngx_http_auth_ldap_cache_init(&shm_zone, cache, 1) == NGX_OK);
+    CHECK(ncache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE].count == 0);
+    CHECK(ncache->sh->records[NGX_HTTP_AUTH_LDAP_CACHE_DN].count == 0);
+    CHECK(ncache->sh->servers_crc == 1);
+
+    ngx_free(ncache);
+    test_cache_destroy(cache);
+}
+
+static void
+test_password_hash(void)
+{
+    u_char hash[SHA_DIGEST_LENGTH + 1], other[SHA_DIGEST_LENGTH + 1], hex[2 * SHA_DIGEST_LENGTH];
+    ngx_str_t username = ngx_string("alice"), password = ngx_string("secret"), nul_username;
+
+    // SHA-1 of "alice|secret"
+    ngx_http_auth_ldap_get_password_hash(&username, &password, hash);
+    ngx_hex_dump(hex, hash, SHA_DIGEST_LENGTH);
+    CHECK(ngx_strncmp(hex, "09a6d1f217d260068b4d31a24d03022a0e3a74d6", sizeof(hex)) == 0);
+    CHECK(hash[SHA_DIGEST_LENGTH] == '\0');
+
+    // credentials are hashed by length, not up to the first NUL
+    nul_username.data = (u_char *) "al\0ice";
+    nul_username.len = 6;
+    ngx_http_auth_ldap_get_password_hash(&nul_username, &password, other);
+    ngx_hex_dump(hex, other, SHA_DIGEST_LENGTH);
+    CHECK(ngx_strncmp(hex, "8e61abdf5acce3606e0ac5faf8e230bdc22005da", sizeof(hex)) == 0);
+}
+
+/**
+ * Times insert, lookup, expiry and eviction with n records in the zone, lock taken per operation
+ * like the module does
+ */
+static void
+bench(ngx_uint_t n)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    u_char buf[TEST_KEY_LEN];
+    ngx_str_t key;
+    ngx_uint_t i, found;
+    double start, insert, hit, miss, expire, evict;
+
+    if (n == 0) {
+        return;
+    }
+
+    cache = test_cache_create(n * TEST_RECORD_SIZE + 256 * ngx_pagesize);
+
+    start = test_now();
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 0, n);
+    insert = test_now() - start;
+
+    // records are visited in scattered order, so the tree is not walked along one path
+    found = 0;
+    start = test_now();
+    for (i = 0; i < n; i++) {
+        test_key(&key, buf, (i * 7919) % n);
+        found += test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key);
+    }
+    hit = test_now() - start;
+
+    start = test_now();
+    for (i = n; i < 2 * n; i++) {
+        test_key(&key, buf, i);
+        found += test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key);
+    }
+    miss = test_now() - start;
+
+    if (found != n) {
+        fprintf(stderr, "bench %lu: %lu records found\n", (unsigned long) n, (unsigned long) found);
+        failures++;
+    }
+
+    // every insert pushes out the least recently used record
+    cache->max_entries[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE] = n;
+    start = test_now();
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, n, n);
+    evict = test_now() - start;
+
+    test_advance(cache->ttl[NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE]);
+    start = test_now();
+    while (ngx_http_auth_ldap_cache_expire(cache, &test_log) == NGX_AGAIN) { /* void */ }
+    expire = test_now() - start;
+
+    printf("%8lu entries: insert %6.0f ns, hit %6.0f ns, miss %6.0f ns, insert+evict %6.0f ns, expire %6.0f ns\n",
+        (unsigned long) n, insert * 1e9 / n, hit * 1e9 / n, miss * 1e9 / n, evict * 1e9 / n, expire * 1e9 / n);
+
+    test_cache_destroy(cache);
+}
+
+/**
+ * Forked processes share one zone, each does lookups of random users and stores every 20th
+ * of them again, as workers do with cache hits and new authentications
+ */
+static void
+contention(ngx_uint_t procs)
+{
+    ngx_http_auth_ldap_cache_t *cache;
+    u_char buf[TEST_KEY_LEN], hash[SHA_DIGEST_LENGTH];
+    ngx_str_t key, value;
+    ngx_uint_t i, p, seed;
+    ngx_pid_t pid;
+    int status;
+    double start, elapsed;
+
+    if (procs == 0) {
+        return;
+    }
+
+    cache = test_cache_create(TEST_CONTENTION_ENTRIES * TEST_RECORD_SIZE + 256 * ngx_pagesize);
+    test_put_n(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, 0, TEST_CONTENTION_ENTRIES);
+
+    start = test_now();
+
+    for (p = 0; p < procs; p++) {
+        pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(2);
+        }
+        if (pid != 0) {
+            continue;
+        }
+
+        // lock is owned by pid, as in nginx workers
+        ngx_pid = ngx_getpid();
+        seed = ngx_pid;
+        ngx_memset(hash, 'h', SHA_DIGEST_LENGTH);
+        value.data = hash;
+        value.len = SHA_DIGEST_LENGTH;
+
+        for (i = 0; i < TEST_CONTENTION_OPS; i++) {
+            seed = seed * 1103515245 + 12345;
+            test_key(&key, buf, (seed >> 8) % TEST_CONTENTION_ENTRIES);
+            if (i % 20 == 0) {
+                ngx_http_auth_ldap_cache_put(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key, &value, &test_log);
+            } else {
+                test_find(cache, NGX_HTTP_AUTH_LDAP_CACHE_POSITIVE, &key);
+            }
+        }
+
+        _exit(0);
+    }
+
+    for (p = 0; p < procs; p++) {
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "contention: child failed\n");
+            failures++;
+        }
+    }
+
+    elapsed = test_now() - start;
+
+    printf("%2lu processes: %10.0f ops/s total, %8.0f ns/op per process\n",
+        (unsigned long) procs, procs * TEST_CONTENTION_OPS / elapsed, elapsed * 1e9 / TEST_CONTENTION_OPS);
+
+    test_cache_destroy(cache);
+}